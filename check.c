@@ -0,0 +1,220 @@
+/*
+ * check.c
+ * Correctness checks for the mm.c calls the malloc lab driver does not
+ * exercise, in the DRIVER build.
+ *
+   Checks, each run at 1, 2, 4, ... up to -t threads:
+     batch    malloc_batch and free_batch of a slab, a cached and an
+              uncached size, each after an empty batch, and no two
+              objects of a batch overlapping
+     trace    allocate and free batches of blocks with MM_TRACE on, then
+              wait for the flusher to have written a record of every op.
+              MM_TRACE is set to a temporary file unless it is set
+              already, and the capture is left there for replay
+   Every thread does -n ops. A check prints ok or what went wrong, and
+   the program exits with status 1 if any check failed.
+
+   Build it next to memlib.c and mm.h from the driver:
+     gcc -O2 -DDRIVER -o check check.c mm.c memlib.c -lpthread
+   and run
+     ./check [-t threads] [-n ops] [batch|trace...]
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define MAX_THREADS 256
+#define BATCH_N 32
+#define TRACE_BATCH 100
+#define TRACE_REC 40     /* bytes of one record in an MM_TRACE capture */
+#define TRACE_WAIT 1000  /* ms the flusher gets to catch up */
+
+struct check {
+  const char* name;
+  void* (*run)(void* arg);  //returns NULL if all went well
+};
+
+/* what one thread of a run gets */
+struct worker {
+  int id;
+  int nthreads;
+  long ops;
+};
+
+static pthread_barrier_t barrier;
+static char trace_tmp[] = "/tmp/check-trace-XXXXXX";
+static const char* trace_path = trace_tmp;
+
+/*
+  allocate and free batches of a slab size, a size the thread cache
+  keeps and one it doesn't, each after an empty batch, and check that
+  no two objects of a batch overlap
+*/
+static void* batch(void* arg) {
+  static const size_t sizes[] = { 48, 400, 4096 };
+  struct worker* w = arg;
+  unsigned char* ptrs[BATCH_N];
+  long k;
+  size_t i, n;
+  for (k = 0; k < w->ops; k += 2*BATCH_N) {
+    size_t size = sizes[k / (2*BATCH_N) % 3];
+    if (malloc_batch(size, (void**)ptrs, 0) != 0) {
+      fprintf(stderr, "batch: an empty batch of %zu bytes got objects\n", size);
+      return w;
+    }
+    free_batch((void**)ptrs, 0);
+    if ((n = malloc_batch(size, (void**)ptrs, BATCH_N)) == 0) {
+      fprintf(stderr, "batch: no objects of %zu bytes\n", size);
+      return w;
+    }
+    for (i = 0; i < n; i++)
+      memset(ptrs[i], i, size);
+    for (i = 0; i < n; i++) {
+      if (ptrs[i][0] != i || ptrs[i][size-1] != i) {
+        fprintf(stderr, "batch: objects of %zu bytes overlap\n", size);
+        return w;
+      }
+    }
+    free_batch((void**)ptrs, n);
+  }
+  return NULL;
+}
+
+/*
+  allocate and free batches of blocks with MM_TRACE on. Thread 0 then
+  waits for the capture to grow by a record for every malloc and free
+*/
+static void* trace_test(void* arg) {
+  struct worker* w = arg;
+  void* ptrs[TRACE_BATCH];
+  struct stat st = { 0 };
+  off_t want = 0;
+  long k;
+  int i;
+  if (w->id == 0 && stat(trace_path, &st) == 0)
+    want = st.st_size;
+  pthread_barrier_wait(&barrier);  //nobody traces before the size is taken
+  for (k = 0; k < w->ops; k += 2*TRACE_BATCH) {
+    for (i = 0; i < TRACE_BATCH; i++)
+      ptrs[i] = malloc(64);
+    for (i = 0; i < TRACE_BATCH; i++)
+      free(ptrs[i]);
+  }
+  pthread_barrier_wait(&barrier);
+  if (w->id != 0)
+    return NULL;
+  want += (off_t)w->nthreads * ((w->ops + 2*TRACE_BATCH - 1) / (2*TRACE_BATCH)) * 2*TRACE_BATCH * TRACE_REC;
+  for (i = 0; i < TRACE_WAIT && (stat(trace_path, &st) < 0 || st.st_size < want); i++)
+    usleep(1000);
+  if (i == TRACE_WAIT) {
+    fprintf(stderr, "trace: %s has %ld of %ld bytes\n", trace_path, (long)st.st_size, (long)want);
+    return w;
+  }
+  return NULL;
+}
+
+static const struct check checks[] = {
+  { "batch", batch },
+  { "trace", trace_test },  //last, tracing stays on once it starts
+};
+
+/* point MM_TRACE at a temporary file unless it is set already */
+static int trace_file(void) {
+  const char* path = getenv("MM_TRACE");
+  int fd;
+  if (path != NULL && *path != '\0') {
+    trace_path = path;
+    return 0;
+  }
+  if ((fd = mkstemp(trace_tmp)) < 0)
+    return -1;
+  close(fd);
+  printf("trace     capture in %s\n", trace_tmp);
+  return setenv("MM_TRACE", trace_tmp, 1);
+}
+
+/*
+  run the check on n threads with a fresh heap and print how it went.
+  Return -1 if it failed or the threads could not be started
+*/
+static int run(const struct check* c, int n, long ops) {
+  pthread_t tid[MAX_THREADS];
+  struct worker w[MAX_THREADS];
+  void* failed = NULL;
+  int i;
+  if (c->run == trace_test && trace_file() < 0) {
+    perror("trace");
+    return -1;
+  }
+  mem_reset_brk();
+  if (mm_init() < 0)
+    return -1;
+  pthread_barrier_init(&barrier, NULL, n);
+  for (i = 0; i < n; i++) {
+    w[i].id = i;
+    w[i].nthreads = n;
+    w[i].ops = ops;
+    if (pthread_create(&tid[i], NULL, c->run, &w[i]) != 0)
+      return -1;
+  }
+  for (i = 0; i < n; i++) {
+    void* res;
+    pthread_join(tid[i], &res);
+    if (res != NULL)
+      failed = res;
+  }
+  pthread_barrier_destroy(&barrier);
+  printf("%-9s %3d threads %s\n", c->name, n, failed != NULL ? "FAILED" : "ok");
+  fflush(stdout);
+  return failed != NULL ? -1 : 0;
+}
+
+int main(int argc, char** argv) {
+  int maxthreads = 4, failed = 0, named = 0;
+  long ops = 100000;
+  unsigned int k;
+  int i, n;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+      maxthreads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+      ops = atol(argv[++i]);
+    else
+      break;
+  }
+  if ((i < argc && argv[i][0] == '-') || maxthreads < 1 || maxthreads > MAX_THREADS || ops < 1) {
+    fprintf(stderr, "usage: %s [-t threads] [-n ops] [batch|trace...]\n", argv[0]);
+    return 2;
+  }
+  mem_init();
+  for (k = 0; k < sizeof(checks)/sizeof(checks[0]); k++) {
+    const struct check* c = &checks[k];
+    int j, want = i == argc;
+    for (j = i; j < argc; j++)
+      want |= strcmp(argv[j], c->name) == 0;
+    if (!want)
+      continue;
+    named++;
+    for (n = 1; ; n = n*2 > maxthreads && n < maxthreads ? maxthreads : n*2) {
+      if (run(c, n, ops) < 0) {
+        failed = 1;
+        break;
+      }
+      if (n == maxthreads)
+        break;
+    }
+  }
+  if (named == 0) {
+    fprintf(stderr, "%s: no such check\n", argv[0]);
+    return 2;
+  }
+  return failed;
+}
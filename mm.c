@@ -8,13 +8,33 @@
    that fits the allocated size. If found, try to the split the block and return the block. If not found,
    extend the heap. When function free is called, it puts the block back into the seg list and try to 
    coalesce it if possible.
+   The seg lists form a two-level index (TLSF), so a good fit takes
+   O(1). The heap is split into arenas, one per CPU, each with its own
+   lock. Requests up to 256 bytes come from slabs, small ones mostly
+   from a thread cache in front of the arenas, and large ones get a
+   mapping of their own. The block format is described with the macros
+   below, and every other part with its settings.
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -37,16 +57,58 @@
 #define calloc mm_calloc
 #endif /* def DRIVER */
 
-/* single word (4) or double word (8) alignment */
-#define ALIGNMENT 8
+#ifdef DRIVER
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define free_sized mm_free_sized
+#define free_aligned_sized mm_free_aligned_sized
+#define malloc_usable_size mm_malloc_usable_size
+#endif
+
+/* block format. A block is a 4 byte header with the size and, in its low
+   bits, the allocated flag, PREV_ALLOC and the PURGED and SAMPLED flags
+   further down, then the payload, 16 byte aligned as max_align_t and SSE
+   data want. Only free blocks have a footer; PREV_ALLOC says whether the
+   left neighbour is allocated, which is all coalesce needs to know before
+   it reads the left footer. A free block keeps the next link of its seg
+   list in the first 4 bytes of its payload and the prev link in the next
+   4, so it comes out of its list in constant time. Links are 32-bit
+   offsets from heap_base, and the smallest block is 16 bytes */
+#define ALIGN_LOG2 4
+#define ALIGNMENT (1 << ALIGN_LOG2)
 #define WSIZE 4
 #define DSIZE 8
+#define MINSIZE (4*WSIZE)  /* header, next, prev and footer */
+#define PREV_ALLOC 0x2     /* header flag: the block to the left is allocated */
 
 /* rounds up to the nearest multiple of ALIGNMENT */
-#define ALIGN(p) (((size_t)(p) + (ALIGNMENT-1)) & ~0x7)
+#define ALIGN(p) (((size_t)(p) + (ALIGNMENT-1)) & ~(size_t)(ALIGNMENT-1))
+
+static char* heap_base;   //mem_heap_lo, page_owner and the list links start here
+
+/* hardening. Built with MM_HARDEN=1 realloc, free_batch and one free in
+   check_every check their pointer: a block must be allocated and agree
+   with its right neighbour's PREV_ALLOC, a slab object must sit on an
+   object boundary below the bump pointer. In between a free only looks
+   for a second free, through the alloc bit of a block or the tag a cached
+   object carries after its next link. All links are XORed with a random
+   secret and the page they sit in, as glibc's safe-linking does */
+#ifndef MM_HARDEN
+#define MM_HARDEN 0  /* 1 checks the pointers freed and encodes the links */
+#endif
+#define POISON_BYTE 0xdb  /* fills freed payloads when poison is set */
+#define CHECK_EVERY 64    /* frees between two full pointer checks */
+
+static unsigned long link_secret;  //MM_HARDEN: mixed into every stored link
+static void harden_fail(const char* what, const void* p) __attribute__((noreturn));
 
+/* what a link stored at p is XORed with: the secret and p's page number */
+static inline unsigned long link_mask(const char* p) {
+  return MM_HARDEN ? link_secret ^ ((size_t)p >> 12) : 0;
+}
 
-inline unsigned int PACK(int size, int alloc) {
+inline unsigned int PACK(unsigned int size, int alloc) {
   return size | alloc;
 }
 
@@ -60,156 +122,1109 @@ inline void PUT(unsigned int *p, unsigned int val) {
 
 }
 inline unsigned int GET_SIZE(char* p) {
-  return (GET(p) & 0x7ffffffe);
+  return (GET(p) & ~(unsigned int)(ALIGNMENT-1));  //the low bits are flags
 }
 
 inline unsigned int GET_ALLOC(char* p) {
   return (GET(p) & 0x1);
 }
 
+inline unsigned int GET_PREV_ALLOC(char* p) {
+  return (GET(p) & PREV_ALLOC) >> 1;
+}
+
+inline void SET_PREV_ALLOC(char* p, int alloc) {
+  *(unsigned int*)p = alloc ? GET(p) | PREV_ALLOC : GET(p) & ~PREV_ALLOC;
+}
+
 inline char* FOOTER(char*p) {
   return (p+GET_SIZE(p)-WSIZE);
 }
 
-inline char*NEXT_FREE(char*p) {
-  return (*(char**)(p+WSIZE));
+/* the list links are 32-bit offsets from heap_base, 0 stands for NULL */
+static inline char*GET_LINK(char*p) {
+  unsigned int off = *(unsigned int*)p ^ (unsigned int)link_mask(p);
+  if (MM_HARDEN && off != 0 && (off + WSIZE + (size_t)heap_base) % ALIGNMENT != 0)
+    harden_fail("corrupted free list link", p);
+  return off ? heap_base + off : NULL;
+}
+
+static inline void SET_LINK(char*p, char*to) {
+  *(unsigned int*)p = (to ? to - heap_base : 0) ^ (unsigned int)link_mask(p);
+}
+
+static inline char*NEXT_FREE(char*p) {
+  return GET_LINK(p+WSIZE);
+}
+
+static inline char*PREV_FREE(char*p) {
+  return GET_LINK(p+2*WSIZE);
+}
+
+static inline void SET_NEXT(char*p, char*next) {
+  SET_LINK(p+WSIZE,next);
+}
+
+static inline void SET_PREV(char*p, char*prev) {
+  SET_LINK(p+2*WSIZE,prev);
+}
+
+/* under a sorted fit policy a large free block is also a node of its
+   list's index, a treap, with two more links and the size of the
+   largest block below it */
+#define TREE_HDR (6*WSIZE)  /* header, list links and node of a large free block */
+
+static inline char*TREE_LEFT(char*p) {
+  return GET_LINK(p+3*WSIZE);
+}
+
+static inline char*TREE_RIGHT(char*p) {
+  return GET_LINK(p+4*WSIZE);
+}
+
+static inline void SET_LEFT(char*p, char*left) {
+  SET_LINK(p+3*WSIZE,left);
+}
+
+static inline void SET_RIGHT(char*p, char*right) {
+  SET_LINK(p+4*WSIZE,right);
+}
+
+static inline unsigned int TREE_MAX(char*p) {
+  return p ? GET(p+5*WSIZE) : 0;
+}
+
+
+/* large allocations. Requests of mmap_threshold bytes or more, and any
+   request too large for a block header, get a mapping of their own with
+   the mapped length in front of the payload */
+#define MAX_BLOCK 0x7fff0000  /* largest block mem_sbrk can take, headers hold < 4 GiB */
+#define MAX_HEAP_REQUEST (MAX_BLOCK - WSIZE)  /* largest request a block holds */
+#define MAP_HDR ALIGNMENT     /* mapped length, padded to keep the payload aligned */
+#ifdef DRIVER
+#define MMAP_THRESHOLD (MAX_HEAP_REQUEST + 1) /* the driver wants heap payloads */
+#else
+#define MMAP_THRESHOLD (1UL << 20)
+#endif
+
+/* returning memory. Once an arena has freed purge_threshold bytes into
+   large free blocks, and at most once every purge_interval ms, the inner
+   pages of those blocks are released with madvise and they are flagged
+   PURGED. A free block right below the epilogue is trimmed off instead */
+#define PURGED 0x4    /* header flag: the free block's pages were released */
+#define SAMPLED 0x8   /* header flag: the allocated block is in the heap profile */
+#define PURGE_THRESHOLD (256UL << 10)  /* smallest free block worth purging */
+#define PURGE_INTERVAL 1000  /* ms between two purges of one arena */
+
+/* calloc. Mappings are zero already, and so is the part of a block
+   carved from reserve that was never used, which every region tracks in
+   clean; only the rest is cleared */
+#ifndef SBRK_ZEROED
+#ifdef DRIVER
+#define SBRK_ZEROED 0  /* the driver recycles one heap for every trace */
+#else
+#define SBRK_ZEROED 1  /* memory fresh from mem_sbrk reads as zero */
+#endif
+#endif
+#define NT_ZERO (1UL << 20)  /* zero at least this much with non-temporal stores */
+
+/* placement of large blocks. fit_policy applies from POLICY_MINSIZE up.
+   Address ordered and best fit keep those lists sorted, each indexed by a
+   treap whose nodes know the largest block below them, and take the first
+   block that fits in O(log n) */
+#define FIT_GOOD 0     /* head of the first list that surely fits, LIFO lists */
+#define FIT_ADDRESS 1  /* lists sorted by address, lowest fitting block */
+#define FIT_BEST 2     /* lists sorted by size, smallest fitting block */
+#define POLICY_LOG2 12
+#define POLICY_MINSIZE (1 << POLICY_LOG2)  /* smallest block fit_policy applies to */
+#define POLICY_LISTS ((32 - POLICY_LOG2) << SL_LOG2)  /* seg lists from there up */
+
+/* lazy coalescing. With lazy_coalesce set, freed blocks up to QL_MAXSIZE
+   wait on a quick list of their exact size, still marked allocated, and
+   are coalesced all at once when the seg lists have nothing that fits */
+#define QL_MAXSIZE 4096  /* largest block kept on an arena quick list */
+#define QL_COUNT (QL_MAXSIZE/ALIGNMENT + 1)
+#define QL_MAX 256  /* quick blocks an arena holds before they are all freed */
+
+/* statistics. Threads count per size class and arenas under their lock,
+   both with plain stores, and mm_getstat adds them up when asked */
+#ifndef MM_STATS
+#define MM_STATS 1  /* 0 compiles the counters out */
+#endif
+#define STAT_SCANS 8  /* fit_scan.i counts scans of [2^(i-1), 2^i) blocks */
+
+/* heap profile. With prof_sample set, about one allocation every
+   prof_sample bytes gets the SAMPLED flag and its backtrace recorded in a
+   side table, which mm_prof_dump writes as a pprof heap profile */
+#define PROF_DEPTH 32      /* frames kept per sample */
+#define PROF_LOG2 12  /* log2 of the hash buckets of the sample table */
+#define PROF_BUCKETS (1 << PROF_LOG2)
+#define PROF_RECHECK (1L << 30)  /* bytes between two looks at prof_sample when it is 0 */
+
+/* trace capture. With MM_TRACE set when mm_init runs, every call appends
+   a record to a ring of its thread, and a flusher thread writes the rings
+   out to the file. replay.c reads it back */
+#define TRACE_RING (1 << 14)  /* records a thread buffers, it waits when they are full */
+#define TRACE_PERIOD 1000000  /* ns between two flushes */
+#define TRACE_MAGIC "MMTRACE1"  /* first 8 bytes of a trace file */
+
+/* heap checker. mm_check walks the heap in slices of a bounded number of
+   blocks, one arena lock at a time, so it can run in a live process.
+   What it returns: */
+#define CHECK_DONE 1         /* the slice finished a pass over the heap */
+#define CHECK_OK 0
+#define CHECK_PROLOGUE -1    /* a region does not start with a prologue */
+#define CHECK_EPILOGUE -2    /* a region does not end in an epilogue */
+#define CHECK_SIZE -3        /* a block is too small or runs past its region */
+#define CHECK_ALIGN -4       /* a payload is not aligned */
+#define CHECK_OWNER -5       /* page_owner gives the block to another arena */
+#define CHECK_PREV_ALLOC -6  /* a PREV_ALLOC bit is wrong */
+#define CHECK_FOOTER -7      /* a free block's footer differs from its header */
+#define CHECK_COALESCE -8    /* two free blocks are neighbours */
+#define CHECK_LIST -9        /* a free block is not linked into its seg list */
+#define CHECK_BITMAP -10     /* the bitmaps disagree with the seg lists */
+#define CHECK_QUICK -11      /* a quick list holds a wrong block */
+#define CHECK_SLAB -12       /* a slab page or a partial slab list is wrong */
+#define CHECK_ERRORS 13
+
+/* object pools. A pool cuts objects of one size out of chunks it takes
+   from its thread's arena, with no header, and frees the chunks when it
+   is destroyed. It belongs to one thread at a time */
+#define POOL_CHUNK (16UL << 10)       /* first chunk a pool takes */
+#define POOL_CHUNK_MAX (1UL << 20)    /* chunks double up to this */
+#define POOL_MIN_OBJS 8               /* objects a chunk holds at least */
+
+/* bump regions. A region bumps a pointer through chunks taken like a
+   pool's, and frees them all together on reset or destroy */
+#define SCRATCH_CHUNK (16UL << 10)      /* first chunk a region takes */
+#define SCRATCH_CHUNK_MAX (1UL << 20)   /* chunks double up to this */
+#define SCRATCH_HDR ALIGNMENT           /* link to the chunk before, padded */
+
+/* huge pages and NUMA. With huge_pages set, arenas grow by whole huge
+   pages that are madvised MADV_HUGEPAGE and purged whole. With numa set,
+   an arena's chunks are placed with mbind on the node of its first thread */
+#define HUGE_PAGE_SIZE (2UL << 20)  /* transparent huge page on x86-64 and arm64 */
+#define NUMA_NODES 1024  /* nodes in the mbind mask */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1  /* from numaif.h */
+#endif
+
+/* heap growth. An arena grows by at least grow_chunk bytes, twice the
+   last chunk up to grow_chunk_max, and the request is cut out of the new
+   room by place() */
+#define GROW_CHUNK (64UL << 10)      /* first chunk an arena grows by */
+#define GROW_CHUNK_MAX (1UL << 20)   /* chunks double up to this */
+
+/* next pointer of a cached or queued object, kept in its first word */
+static inline char*NEXT_OBJ(char*p) {
+  char* next = (char*)(*(size_t*)p ^ link_mask(p));
+  if (MM_HARDEN && (size_t)next % ALIGNMENT != 0)
+    harden_fail("corrupted free list link", p);
+  return next;
+}
+
+static inline void SET_NEXT_OBJ(char*p, char*next) {
+  *(size_t*)p = (size_t)next ^ link_mask(p);
+}
+
+/* MM_HARDEN: tag an object of 16 bytes or more that is freed but still
+   marked allocated, in the word after its next link */
+static unsigned long free_tag;
+
+static inline void TAG_FREE(char*p) {
+  if (MM_HARDEN)
+    ((unsigned long*)p)[1] = free_tag;
+}
+
+static inline void UNTAG(char*p) {
+  if (MM_HARDEN)
+    ((unsigned long*)p)[1] = 0;
+}
+
+/* slabs. Requests up to SLAB_MAXSIZE come from slabs: pages cut into
+   objects of one size class with no header, found through PAGE_SLAB in
+   page_owner. The classes follow from the three *_LOG2 knobs, which can
+   be set with -D: one class every ALIGNMENT bytes up to SLAB_LINEAR, then
+   2^SLAB_SL_LOG2 classes per power of two up to SLAB_MAXSIZE */
+#ifndef SLAB_LINEAR_LOG2
+#define SLAB_LINEAR_LOG2 7
+#endif
+#ifndef SLAB_SL_LOG2
+#define SLAB_SL_LOG2 2
+#endif
+#ifndef SLAB_MAX_LOG2
+#define SLAB_MAX_LOG2 8
+#endif
+#define SLAB_LINEAR (1 << SLAB_LINEAR_LOG2)
+#define SLAB_MAXSIZE (1 << SLAB_MAX_LOG2)  /* largest request served from a slab */
+#define NSLAB_LINEAR (SLAB_LINEAR / ALIGNMENT)
+#define NSLAB (NSLAB_LINEAR + ((SLAB_MAX_LOG2 - SLAB_LINEAR_LOG2) << SLAB_SL_LOG2))
+#define PAGE_SLAB 0x80   /* page_owner flag: the page is a slab */
+_Static_assert(SLAB_LINEAR_LOG2 - SLAB_SL_LOG2 >= ALIGN_LOG2,
+               "slab classes must be multiples of ALIGNMENT");
+_Static_assert(SLAB_MAX_LOG2 >= SLAB_LINEAR_LOG2 && SLAB_MAX_LOG2 <= 10,
+               "slab classes must fit a page several times");
+
+struct slab {
+  struct slab* next;  //partial slabs of the class in the arena
+  struct slab* prev;
+  char* free;   //freed objects, linked through their first word
+  char* bump;   //objects past this one were never handed out
+  unsigned short cls;
+  unsigned short nfree;
+  unsigned short nobj;
+};
+
+#define SLAB_HDR ((sizeof(struct slab) + ALIGNMENT-1) & ~(ALIGNMENT-1))
+
+/* slab class of a request of 1 to SLAB_MAXSIZE bytes */
+static inline int slab_class(size_t size) {
+  int fl;
+  if (size <= SLAB_LINEAR)
+    return (size - 1) >> ALIGN_LOG2;
+  fl = 8*sizeof(long) - 1 - __builtin_clzl(size - 1);
+  return NSLAB_LINEAR + ((fl - SLAB_LINEAR_LOG2) << SLAB_SL_LOG2) +
+    (((size - 1) >> (fl - SLAB_SL_LOG2)) & ((1 << SLAB_SL_LOG2) - 1));
+}
+
+/* object size of the slab class cls */
+static inline unsigned int slab_size(int cls) {
+  int k = cls - NSLAB_LINEAR;
+  if (k < 0)
+    return (cls + 1) << ALIGN_LOG2;
+  return ((1 << SLAB_SL_LOG2) + (k & ((1 << SLAB_SL_LOG2) - 1)) + 1)
+    << (SLAB_LINEAR_LOG2 + (k >> SLAB_SL_LOG2) - SLAB_SL_LOG2);
 }
 
+/* arenas. Each has its own lock, seg lists and regions from mem_sbrk,
+   and page_owner says which arena a heap page belongs to. The seg lists
+   form a two-level index (TLSF): one list per ALIGNMENT bytes below
+   SMALL_BLOCK, then SL_COUNT lists per power of two, with bitmaps of the
+   non-empty ones. SL_LOG2 can be set with -D, the seg lists follow from it */
+#ifndef SL_LOG2
+#define SL_LOG2 4
+#endif
+#define SL_COUNT (1 << SL_LOG2)     /* second level lists per power of two */
+#define FL_SHIFT (SL_LOG2 + ALIGN_LOG2)  /* log2 of SMALL_BLOCK */
+#define SMALL_BLOCK (1 << FL_SHIFT) /* below this, one list per ALIGNMENT bytes */
+#define FL_COUNT (32 - FL_SHIFT + 1) /* first level rows, block sizes < 2^32 */
+#define NBUCKETS (FL_COUNT * SL_COUNT)
+#define MAX_ARENAS 64
+_Static_assert(POLICY_LOG2 >= FL_SHIFT, "sorted policies start on a seg list row");
+#define ARENA_PROBES 2    /* busy arenas skipped before waiting on our own */
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+#define MAX_HEAP_SPAN (1UL << 32)   /* heap bytes page_owner can describe */
+#define REGION_HDR DSIZE   /* link to the arena's previous region */
+
+/* counters of an arena, only written under its lock */
+struct arena_stats {
+  unsigned long fit_hit;   //first_fit found a block
+  unsigned long fit_miss;
+  unsigned long fit_scan[STAT_SCANS];  //blocks first_fit looked at, log2 buckets
+  unsigned long nextend;   //extend_heap calls
+  unsigned long extend_bytes;  //bytes grow_arena took from mem_sbrk
+  unsigned long ncoalesce[4];  //merged nothing, the left, the right, both
+};
+
+struct arena {
+  pthread_mutex_t lock;
+  char* buckets[NBUCKETS];  //heads of the seg lists, row by row
+  char* trees[POLICY_LISTS];  //roots of the indexes of the large lists, sorted policies only
+  size_t fit;     //fit_policy the large lists are kept for
+  unsigned int fl_bitmap;   //bit i is set when row i has a block
+  unsigned int sl_bitmap[FL_COUNT]; //bit j of row i: buckets[i*SL_COUNT+j]
+  char* top;      //epilogue header of the region being grown
+  char* end;      //end of the memory reserved from mem_sbrk for that region
+  char* regions;  //most recent region, each links to the one before
+  struct slab* slabs[NSLAB];  //slabs with free objects, per class
+  size_t dirty;     //bytes freed into large blocks since the last purge
+  long last_purge;  //ms timestamp of the last purge
+  size_t chunk;     //bytes the next grow_arena takes at least, 0 until first use
+  char* clean;      //reserve from here to end is untouched since mem_sbrk, or NULL
+  char* quick[QL_COUNT];  //lazily freed blocks by exact size, still marked allocated
+  unsigned int nquick;
+  struct arena_stats stats;
+  char* check;         //block mm_check looks at next, NULL until it starts on the arena
+  char* check_region;  //region of that block
+  int node;     //NUMA node+1 its chunks are placed on, 0 until a thread picks it
+  /* objects freed by threads of other arenas, linked through NEXT_OBJ.
+     Pushed without the lock, emptied by the lock holder. Kept on its own
+     cache line so remote pushes don't bounce the lock's line */
+  char* remote __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+/* thread cache: one bin per slab class, then one per block size from
+   SLAB_MAXSIZE+16 to TC_MAXSIZE. A cached object stays allocated */
+#ifndef TC_MAXSIZE
+#define TC_MAXSIZE 512  /* largest block size kept in a thread cache */
+#endif
+_Static_assert(TC_MAXSIZE > SLAB_MAXSIZE && TC_MAXSIZE % ALIGNMENT == 0,
+               "thread cache block bins start past the slabs");
+#define TC_BINS (NSLAB + (TC_MAXSIZE-SLAB_MAXSIZE)/ALIGNMENT)
+#define TC_FILL 8   /* objects carved out per refill */
+#define TC_MAX 32   /* objects a bin holds before half of it is flushed */
+#define BATCH_BYTES (1UL << 20)  /* most malloc_batch cuts out of one block */
+
+/* counters of a thread, only written by the thread itself. Classes are
+   the tcache bins, then one per seg list row above TC_MAXSIZE */
+#define STAT_CLASSES (TC_BINS + FL_COUNT)
+struct thread_stats {
+  unsigned long nmalloc[STAT_CLASSES];
+  unsigned long nfree[STAT_CLASSES];
+  unsigned long nmap;    //allocations given their own mapping
+  unsigned long nunmap;
+};
+
+/* one op of a captured trace, as it is written to the file */
+struct trace_rec {
+  unsigned long time;   //TSC ticks, or ns where there is no TSC
+  unsigned long ptr;    //payload returned, or freed
+  unsigned long old;    //payload realloc was given
+  unsigned long size;   //bytes asked for
+  unsigned int thread;  //kernel thread id
+  unsigned int op;      //'a' malloc, 'c' calloc, 'r' realloc, 'f' free
+};
+
+/* records of one thread on their way to the file. The thread moves head,
+   the flusher tail */
+struct trace_ring {
+  unsigned long head;
+  unsigned long tail __attribute__((aligned(64)));
+  unsigned int thread;
+  struct trace_rec rec[TRACE_RING];
+};
+
+struct tcache {
+  struct tcache* next;    //list of every thread's cache, for the stats
+  struct tcache** pprev;  //NULL until the thread is on the list
+  struct trace_ring* ring;  //mapped on the first traced op
+  int released;       //tcache_release has run, the thread is exiting
+  unsigned long gen;  //heap generation the cached objects belong to
+  struct arena* arena;  //arena picked by the cpu the thread ran on
+  unsigned int limit;   //objects a bin holds, TC_MAX or 0 once released
+  char* bins[TC_BINS];  //payload pointers linked through NEXT_OBJ
+  /* a bin keeps no count of its objects, they are what went in less what
+     malloc took out. Its frees are what went in less what was refilled.
+     Plain increments, the stats readers may see them a little late */
+  unsigned long nin[TC_BINS];      //objects freed or refilled into the bin, less those flushed
+  unsigned long nmalloc[TC_BINS];  //objects malloc took from the bin
+  unsigned long nfill[TC_BINS];    //objects refilled less objects flushed, mod 2^64
+  long prof_left;   //bytes to allocate before the next sample
+  int unchecked;    //MM_HARDEN: frees left before check_ptr runs again
+  unsigned long prof_rng;
+  struct thread_stats stats;
+};
+
+/* a pool of objects of one size. Objects are linked through their first
+   word while free, chunks through the first word of their payload */
+struct mm_pool {
+  size_t size;   //object size, a multiple of align
+  size_t align;
+  char* free;    //freed objects
+  char* bump;    //next object never handed out
+  char* end;     //end of the last chunk
+  char* chunks;  //last chunk
+  size_t chunk;  //bytes the next chunk takes
+};
+
+/* a bump region. Chunks are linked through the first word of their
+   payload, the one being bumped through first */
+struct mm_region {
+  char* bump;    //next free byte of the current chunk
+  char* end;     //end of the current chunk
+  char* chunks;  //current chunk, then the ones before
+  size_t chunk;  //bytes the next chunk takes
+};
+
+/* a sampled allocation, hashed by its payload pointer */
+struct prof_rec {
+  struct prof_rec* next;
+  char* p;
+  size_t size;
+  int depth;
+  void* pc[PROF_DEPTH];
+};
+
 
 /* global variables */    
-static char** heap_listp;  //point at the beginning of the heap 
-static char* prevPtr;   //save the prev ptr
+static struct arena* arenas;  //arena table at the beginning of the heap
+static int narenas;
+static char* heap_end;    //current break, anything outside is a mapping
+static pthread_mutex_t sbrk_lock = PTHREAD_MUTEX_INITIALIZER; //guards mem_sbrk
+static unsigned char page_owner[MAX_HEAP_SPAN >> PAGE_SHIFT]; //arena index+1, PAGE_SLAB
+static unsigned long heap_gen;  //bumped by mm_init so stale caches get dropped
+static size_t mmap_threshold = MMAP_THRESHOLD;
+static size_t purge_threshold = PURGE_THRESHOLD;  //0 turns purging off
+static size_t purge_interval = PURGE_INTERVAL;
+static size_t purge_lazy;  //MADV_FREE instead of MADV_DONTNEED
+static size_t grow_chunk = GROW_CHUNK;
+static size_t grow_chunk_max = GROW_CHUNK_MAX;
+static size_t lazy_coalesce;  //free blocks to the quick lists, coalesce on a miss
+static size_t fit_policy = FIT_GOOD;  //placement of blocks from POLICY_MINSIZE up
+static size_t prof_sample;  //mean bytes between two heap profile samples, 0 is off
+static size_t poison;  //MM_HARDEN: fill freed payloads with POISON_BYTE
+static size_t check_every = CHECK_EVERY;  //MM_HARDEN: frees between two check_ptr calls
+static unsigned int slab_recip[NSLAB];  //MM_HARDEN: 2^32 / object size, rounded up
+static size_t huge_pages;  //grow by whole huge pages and madvise them MADV_HUGEPAGE
+static size_t numa;       //place arena memory on the node of the arena's threads
+static __thread struct tcache tcache;
+static pthread_key_t tcache_key;   //flushes the cache when a thread exits
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; //guards threads
+static struct tcache* threads;  //caches of the live threads
+static struct thread_stats retired;  //counts of the threads that exited
+static size_t heap_size, heap_peak;  //bytes of the arenas below their epilogues
+static size_t mapped_size, mapped_peak;  //bytes mapped by mmap_alloc
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER; //guards the samples
+static struct prof_rec* prof_table[PROF_BUCKETS];
+static struct prof_rec* prof_spare;  //unused records, linked through next
+static size_t prof_live;  //records in prof_table
+static int trace_on;      //MM_TRACE was set and the file is open
+static int trace_fd = -1;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER; //guards trace_fd
+static pthread_mutex_t check_lock = PTHREAD_MUTEX_INITIALIZER; //guards check_arena
+static int check_arena;  //arena mm_check is walking
+
+/* index of the page holding p in page_owner */
+static inline size_t page_index(const char* p) {
+  return ((size_t)p >> PAGE_SHIFT) - ((size_t)heap_base >> PAGE_SHIFT);
+}
+
+/* whether the payload pointer p came from mmap_alloc */
+static inline int is_mapped(const char* p) {
+  return (size_t)(p - heap_base) >= (size_t)(heap_end - heap_base);
+}
+
+/* start of the mapping holding the mapped payload p. The mapped length,
+   counted from there, sits in the MAP_HDR bytes in front of p */
+static inline char* map_start(const char* p) {
+  return (char*)(((size_t)p - MAP_HDR) & ~(PAGE_SIZE-1));
+}
+
+/* whether the payload pointer p is an object in a slab */
+static inline int is_slab(const char* p) {
+  return page_owner[page_index(p)] & PAGE_SLAB;
+}
+
+/* the slab holding the object p */
+static inline struct slab* slab_of(const char* p) {
+  return (struct slab*)((size_t)p & ~(PAGE_SIZE-1));
+}
+
+/* thread cache bin of a block of the given size */
+static inline int block_bin(unsigned int size) {
+  return NSLAB + (size - SLAB_MAXSIZE)/ALIGNMENT - 1;
+}
+
+/* stats class of a block of the given size */
+static inline int block_class(unsigned int size) {
+  if (size <= TC_MAXSIZE)
+    return block_bin(size);
+  return TC_BINS + 8*sizeof(int) - __builtin_clz(size) - FL_SHIFT;  //its row
+}
+
+/* the block bp now reaches up to end. If mm_check stopped at a block it
+   swallowed, it goes on from bp. Caller holds the arena lock */
+static inline void check_merged(struct arena* a, char*bp, char*end) {
+  if (a->check > bp && a->check < end)
+    a->check = bp;
+}
+
+/* add n to a counter only the caller writes, readers load it atomically */
+static inline void stat_add(unsigned long* c, unsigned long n) {
+  if (MM_STATS)
+    __atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+}
+
+/* objects in the bin */
+static inline unsigned long bin_count(struct tcache* tc, int bin) {
+  return tc->nin[bin] - tc->nmalloc[bin];
+}
 
 /*helper functions*/
-static char* extend_heap(int size);
+static char* take_reserve(struct arena* a, char** zero);
+static char* extend_heap(struct arena* a, unsigned int size, char** zero);
+static int grow_arena(struct arena* a, unsigned int size, int contiguous);
 static int getIndex(size_t asize);
-static char* place(unsigned int asize, char*bp, char*prev);
-static void* first_fit(unsigned int asize, int index);
-static void relink(char*bp, char*prev);
-static void* find_prev(char* p);
+static int fitIndex(size_t asize);
+static char* place(struct arena* a, unsigned int asize, char*bp);
+static void* first_fit(struct arena* a, unsigned int asize);
+static void* find_fit(struct arena* a, unsigned int asize);
+static void release_block(struct arena* a, char*bp);
+static void flush_quick(struct arena* a);
+static void relink(struct arena* a, char*bp);
+static void insert_free(struct arena* a, char*bp);
+static inline int is_sorted(struct arena* a, unsigned int size);
+static inline char** tree_root(struct arena* a, int index);
+static int sorts_before(struct arena* a, char*p, char*q);
+static char* tree_insert(struct arena* a, char*t, char*bp, char** pred);
+static char* tree_remove(struct arena* a, char*t, char*bp);
+static void set_fit_policy(void);
+static void* alloc_block(struct arena* a, unsigned int asize);
+static void* alloc_aligned(struct arena* a, unsigned int asize, size_t align);
+static struct slab* new_slab(struct arena* a, int cls);
+static void* slab_alloc(struct arena* a, int cls);
+static void slab_free(struct arena* a, char*p);
+static void free_local(struct arena* a, char*p);
+static size_t usable_size(char*p);
+static void* mmap_alloc(size_t size, size_t align);
+static void* mmap_realloc(char*p, size_t size);
+static size_t block_size(size_t size);
+static void* realloc_in_place(char*p, size_t size);
+static void read_options(void);
+static void free_block(struct arena* a, char*bp);
+static char* coalesce(struct arena* a, char*bp);
+static void maybe_purge(struct arena* a);
+static void purge_block(char*bp);
+static void trim_top(struct arena* a);
+static struct arena* arena_of(char*bp);
+static struct arena* lock_arena(struct tcache* tc);
+static struct arena* thread_arena(struct tcache* tc);
+static void remote_free(struct arena* a, char*p);
+static void drain_remote(struct arena* a);
+static struct tcache* get_tcache(void);
+static void* tcache_refill(struct tcache* tc, int bin, unsigned int asize);
+static void tcache_flush(struct tcache* tc, int bin, unsigned int n);
+static inline void tcache_put(struct tcache* tc, int bin, char*p);
+static void tcache_release(void* arg);
+static void tcache_key_init(void);
+static void split_run(char*bp, unsigned int asize, unsigned int n);
+static void free_run(struct arena* a, char*bp, char*end);
+static int cmp_ptr(const void* x, const void* y);
+static void stat_size(size_t* size, size_t* peak, long delta);
+static void collect_stats(struct thread_stats* ts, struct arena_stats* as);
+static void* prof_alloc(struct tcache* tc, size_t size);
+static long prof_interval(struct tcache* tc);
+static int prof_drop(char*p);
+static int prof_sampled(char*p);
+static void prof_reset(void);
+static int write_all(int fd, const char* buf, size_t n);
+static void trace_start(void);
+static inline unsigned long trace_clock(void);
+static void trace_op(int op, void* p, void* old, size_t size, unsigned long when);
+static void trace_drain(struct trace_ring* r);
+static void trace_flush(void);
+static void zero_bytes(char*p, size_t n);
 static int in_heap(const void *p);
 static int aligned(const void *p);
+static int check_free(struct arena* a, char*bp);
+static int check_block(struct arena* a, char*bp, int prev_alloc, char*limit);
+static int check_lists(struct arena* a, char** where);
+static int check_slice(struct arena* a, size_t* nblocks, char** where);
+static int check_heap(size_t nblocks, char** where);
+static void harden_init(void);
+static void check_ptr(struct tcache* tc, char*p);
+static void harden_free(struct tcache* tc, char*p);
+static int is_freed(struct tcache* tc, char*p);
+static void poison_payload(char*p);
+static char* take_chunk(size_t size, size_t align);
+static int pool_grow(struct mm_pool* pl);
+static void* region_grow(struct mm_region* r, size_t size);
+static void bind_node(char*p, size_t len, int node);
 /*
  * Initialize: return -1 on error, 0 on success.
  */
 int mm_init(void) {
   
-  char* prologue;
-  char* epilogue;
-  if((heap_listp = mem_sbrk(10*DSIZE)) == (void *)-1) 
+  char* brk;
+  int i;
+  long ncpu;
+  pthread_once(&tcache_once, tcache_key_init);
+  read_options();
+  heap_gen++;
+  heap_base = mem_heap_lo();
+  pthread_mutex_lock(&stats_lock);
+  memset(&retired, 0, sizeof(retired));  //the caches reset theirs on next use
+  heap_size = heap_peak = 0;
+  pthread_mutex_unlock(&stats_lock);
+  prof_reset();
+  check_arena = 0;
+  harden_init();
+  ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  narenas = ncpu < 1 ? 1 : (ncpu > MAX_ARENAS ? MAX_ARENAS : ncpu);
+  if ((brk = mem_sbrk(0)) == (void *)-1)
+    return -1;
+  /* keep every arena on its own cache line */
+  if (mem_sbrk((-(size_t)brk & 63) + narenas*sizeof(struct arena)) == (void *)-1)
+    return -1;
+  arenas = (struct arena*)(brk + (-(size_t)brk & 63));
+  for (i = 0; i < narenas; i++) {
+    memset(&arenas[i], 0, sizeof(struct arena));  //empty lists, no regions yet
+    pthread_mutex_init(&arenas[i].lock, NULL);
+    arenas[i].fit = fit_policy;
+  }
+  /* regions are whole pages so no page is shared by two arenas */
+  if ((brk = mem_sbrk(0)) == (void *)-1 ||
+      mem_sbrk(-(size_t)brk & (PAGE_SIZE-1)) == (void *)-1)
+    return -1;
+  heap_end = brk + (-(size_t)brk & (PAGE_SIZE-1));
+  trace_start();  //last, starting the flusher may call malloc
+  return 0;
+}
+
+
+/*
+  tunables: name for mm_setopt, environment variable read by mm_init
+*/
+static const struct option {
+  const char* name;
+  const char* env;
+  size_t* value;
+} options[] = {
+  { "mmap_threshold", "MM_MMAP_THRESHOLD", &mmap_threshold },
+  { "purge_threshold", "MM_PURGE_THRESHOLD", &purge_threshold },
+  { "purge_interval", "MM_PURGE_INTERVAL", &purge_interval },
+  { "purge_lazy", "MM_PURGE_LAZY", &purge_lazy },
+  { "grow_chunk", "MM_GROW_CHUNK", &grow_chunk },
+  { "grow_chunk_max", "MM_GROW_CHUNK_MAX", &grow_chunk_max },
+  { "lazy_coalesce", "MM_LAZY_COALESCE", &lazy_coalesce },
+  { "fit_policy", "MM_FIT_POLICY", &fit_policy },
+  { "prof_sample", "MM_PROF_SAMPLE", &prof_sample },
+  { "poison", "MM_POISON", &poison },
+  { "check_every", "MM_CHECK_EVERY", &check_every },
+  { "huge_pages", "MM_HUGE_PAGES", &huge_pages },
+  { "numa", "MM_NUMA", &numa },
+};
+
+/*
+  keep the tunables in range. A zero or too large mmap threshold
+  only maps what cannot be a block
+*/
+static void clamp_options(void) {
+  if (mmap_threshold == 0 || mmap_threshold > MAX_HEAP_REQUEST + 1)
+    mmap_threshold = MAX_HEAP_REQUEST + 1;
+  if (purge_threshold != 0 && purge_threshold < 4*PAGE_SIZE)
+    purge_threshold = 4*PAGE_SIZE;  //smaller blocks have no inner pages to spare
+  if (huge_pages && purge_threshold != 0 && purge_threshold < 2*HUGE_PAGE_SIZE)
+    purge_threshold = 2*HUGE_PAGE_SIZE;  //nor whole huge pages
+  if (grow_chunk_max > (1UL << 30))
+    grow_chunk_max = 1UL << 30;  //mem_sbrk takes an int
+  if (grow_chunk < PAGE_SIZE || grow_chunk > grow_chunk_max)
+    grow_chunk = grow_chunk < PAGE_SIZE ? PAGE_SIZE : grow_chunk_max;
+  if (grow_chunk_max < grow_chunk)
+    grow_chunk_max = grow_chunk;
+  if (fit_policy > FIT_BEST)
+    fit_policy = FIT_GOOD;
+  if (prof_sample > (1UL << 40))
+    prof_sample = 1UL << 40;  //prof_interval multiplies it in 64 bits
+  if (check_every == 0 || check_every > INT_MAX)
+    check_every = check_every == 0 ? 1 : INT_MAX;  //the countdown is an int
+}
+
+static void read_options(void) {
+  unsigned int i;
+  for (i = 0; i < sizeof(options)/sizeof(options[0]); i++) {
+    const char* v = getenv(options[i].env);
+    if (v != NULL && *v != '\0')
+      *options[i].value = strtoul(v, NULL, 0);
+  }
+  clamp_options();
+}
+
+/*
+  set the tunable called name. Return -1 if there is no such tunable
+*/
+int mm_setopt(const char* name, size_t value) {
+  unsigned int i;
+  for (i = 0; i < sizeof(options)/sizeof(options[0]); i++) {
+    if (strcmp(options[i].name, name) == 0) {
+      *options[i].value = value;
+      clamp_options();
+      if (options[i].value == &fit_policy)
+        set_fit_policy();
+      return 0;
+    }
+  }
+  return -1;
+}
+
+
+/*
+  put the large lists of every arena back in the order fit_policy wants:
+  each list is emptied and its blocks inserted again
+*/
+static void set_fit_policy(void) {
+  int i, index;
+  for (i = 0; i < narenas; i++) {
+    struct arena* a = &arenas[i];
+    pthread_mutex_lock(&a->lock);
+    a->fit = fit_policy;
+    for (index = NBUCKETS - POLICY_LISTS; index < NBUCKETS; index++) {
+      char* bp = a->buckets[index];
+      int fl = index >> SL_LOG2;
+      a->buckets[index] = NULL;
+      *tree_root(a,index) = NULL;
+      a->sl_bitmap[fl] &= ~(1u << (index & (SL_COUNT-1)));
+      if (a->sl_bitmap[fl] == 0)
+        a->fl_bitmap &= ~(1u << fl);
+      while (bp != NULL) {
+        char* next = NEXT_FREE(bp);
+        insert_free(a,bp);
+        bp = next;
+      }
+    }
+    pthread_mutex_unlock(&a->lock);
+  }
+}
+
+
+/* 
+   reserve at least size more bytes for arena a from mem_sbrk, in chunks
+   that double with every growth so a growing heap calls mem_sbrk less
+   and less often. If the chunk lands right after the arena's current
+   region the two are merged, otherwise the tail of the old region is
+   freed and the new one gets its own prologue and epilogue, unless
+   contiguous is set, in which case nothing is taken. Caller holds the
+   arena lock
+ */
+static int grow_arena(struct arena* a, unsigned int size, int contiguous) {
+  size_t need = (size + REGION_HDR + 2*WSIZE + PAGE_SIZE-1) & ~(PAGE_SIZE-1);
+  size_t off;
+  char* p;
+  if (a->chunk < grow_chunk)
+    a->chunk = grow_chunk;
+  if (need < a->chunk)
+    need = (a->chunk + PAGE_SIZE-1) & ~(PAGE_SIZE-1);
+  if (need > (size_t)0x7fffffff)
+    return -1;
+  pthread_mutex_lock(&sbrk_lock);
+  if (contiguous && mem_sbrk(0) != a->end) {
+    pthread_mutex_unlock(&sbrk_lock);
+    return -1;
+  }
+  if (huge_pages)  //end on a huge page, the next growth starts on one
+    need += -((size_t)mem_sbrk(0) + need) & (HUGE_PAGE_SIZE-1);
+  p = need > (size_t)0x7fffffff ? (void*)-1 : mem_sbrk(need);
+  if (p != (void*)-1)
+    __atomic_store_n(&heap_end, p + need, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&sbrk_lock);
+  if (p == (void*)-1 || page_index(p + need - 1) >= (MAX_HEAP_SPAN >> PAGE_SHIFT))
     return -1;
-  *(heap_listp+0) = NULL;  //size <=32
-  *(heap_listp+1) = NULL;  //size <= 64
-  *(heap_listp+2) = NULL;  //size <= 128
-  *(heap_listp+3) = NULL;  //size <= 256
-  *(heap_listp+4) = NULL; //size <= 512
-  *(heap_listp+5) = NULL;  //size <= 1024
-  *(heap_listp+6) = NULL;  //size <= 2048
-  *(heap_listp+7) = NULL;  //size <= 4096
-  *(heap_listp+8) = NULL;  //size > 4096
-  prologue  = (char*)(heap_listp + 9);
-  PUT((unsigned int *)prologue,PACK(0,1));
-  epilogue = prologue + WSIZE;
-  PUT((unsigned int *)epilogue,PACK(0,1));  
+  for (off = 0; off < need; off += PAGE_SIZE)
+    page_owner[page_index(p + off)] = a - arenas + 1;
+  if (huge_pages)
+    madvise(p, need, MADV_HUGEPAGE);
+  if (numa && a->node != 0)
+    bind_node(p, need, a->node - 1);
+  stat_add(&a->stats.extend_bytes, need);
+  a->chunk = a->chunk*2 > grow_chunk_max ? grow_chunk_max : a->chunk*2;
+  if (p == a->end) {
+    if (a->clean == NULL && SBRK_ZEROED)
+      a->clean = p;
+    a->end = p + need;  //contiguous, the epilogue just moves further out
+    return 0;
+  }
+  if (a->top != NULL && a->end - a->top - WSIZE >= MINSIZE) {
+    unsigned int tail = a->end - a->top - WSIZE;
+    PUT((unsigned int*)a->top,PACK(tail,1) | (GET(a->top) & PREV_ALLOC));  //leftover of the old region
+    PUT((unsigned int*)(a->end-WSIZE),PACK(0,1) | PREV_ALLOC);
+    stat_size(&heap_size, &heap_peak, tail);
+    free_block(a, a->top);
+  }
+  *(char**)p = a->regions;
+  a->regions = p;
+  PUT((unsigned int *)(p+REGION_HDR),PACK(0,1));  /* prologue */
+  a->top = p + REGION_HDR + WSIZE;
+  PUT((unsigned int *)a->top,PACK(0,1) | PREV_ALLOC);  /* epilogue */
+  a->end = p + need;
+  a->clean = SBRK_ZEROED ? a->top : NULL;
+  stat_size(&heap_size, &heap_peak, REGION_HDR + 2*WSIZE);
   return 0;
 }
 
+/*
+  turn all the reserved room above the epilogue into one free block,
+  merged with a free block right below it. Returns the merged block,
+  or NULL if there is nothing to turn into a block. If zero is not NULL
+  it gets the address from which the block reads as zero, apart from its
+  footer, or NULL if no part of it does
+*/
+static char* take_reserve(struct arena* a, char** zero) {
+  unsigned int size = a->end - a->top - WSIZE;
+  char*bp = a->top;
+  if (zero != NULL)
+    *zero = NULL;
+  if (size < MINSIZE)
+    return NULL;
+  if (zero != NULL && a->clean != NULL)  //past the header and the links
+    *zero = a->clean > bp + 4*WSIZE ? a->clean : bp + 4*WSIZE;
+  a->clean = NULL;
+  a->top = a->end - WSIZE;
+  PUT((unsigned int*)bp,PACK(size,0) | (GET(bp) & PREV_ALLOC)); /* header*/
+  PUT((unsigned int*)FOOTER(bp),PACK(size,0)); /*footer*/
+  PUT((unsigned int*)a->top,PACK(0,1)); /*new epilogue block*/
+  stat_size(&heap_size, &heap_peak, size);
+  insert_free(a,bp);
+  return coalesce(a,bp);  //not free_block, a fresh chunk is not worth purging
+}
 
 /* 
-   extend the heap if it is full
+   extend the arena's heap if it is full: return a free block of at least
+   size bytes at the top of arena a, growing the arena by a chunk if the
+   reserve and the free block below the epilogue are too small. zero is
+   passed on to take_reserve
  */
-static char* extend_heap(int size) {
-  char*bp = mem_sbrk(size);
-  if (bp == (void*)-1)
-    return bp;
-  PUT((unsigned int*)(bp-WSIZE),PACK(size,1)); /* header*/
-  PUT((unsigned int*)(bp+size-DSIZE),PACK(size,1)); /*footer*/
-  PUT((unsigned int*)(bp+size-WSIZE),PACK(0,1)); /*new epilogue block*/
+static char* extend_heap(struct arena* a, unsigned int size, char** zero) {
+  size_t room = 0, tail = 0;
+  char*bp;
+  stat_add(&a->stats.nextend, 1);
+  if (a->top != NULL) {
+    room = a->end - a->top - WSIZE;
+    if (GET_PREV_ALLOC(a->top) == 0)
+      tail = GET_SIZE(a->top - WSIZE);
+  }
+  if (tail < size && (room < MINSIZE || tail + room < size)) {
+    /* keep the free tail if the break still ends this region */
+    if (a->top == NULL || grow_arena(a, size - tail, 1) < 0)
+      if (grow_arena(a, size, 0) < 0)
+        return NULL;
+  }
+  if ((bp = take_reserve(a,zero)) == NULL)
+    bp = a->top - tail;  //only a sliver left, the tail is big enough
   return bp;
 }
 
 
 /* 
- return the index of the free list
- that the asize belongs to
+ return the index of the free list that the asize belongs to.
+ Row 0 holds the sizes below SMALL_BLOCK, 16 bytes per list. Row r
+ after that covers [2^(r+FL_SHIFT-1), 2^(r+FL_SHIFT)) and the bits
+ below the leading one pick one of its SL_COUNT lists. floor(log2)
+ comes from the leading zero count
 */
 static int getIndex(size_t asize) {
-  int index;
-  if (asize <=32) {
-    index = 0;
-  }
-  else if (asize<=64) {
-    index = 1;
-  }
-  else if (asize<= 128) {
-    index = 2;
-  }
-  else if (asize<= 256 ) {
-    index = 3;
-   }
-  else if (asize<= 512) {
-    index = 4;
-   }
-   else if (asize<=1024) {
-     index = 5;
-   }
-   else if (asize<=2048) {
-     index = 6;
-   }
-   else if (asize<= 4096) {
-     index = 7;
-   }
-   else
-     index = 8;
-  return index;
-}
-
-
-/*
-  search through all the the freeblocks
-  in the seglist. Return NULL if no freeblocks 
-  fit the size. Return the freeblock if the freeblock
-  fits the size
-*/
-static void* first_fit(unsigned int asize, int index) { 
-  prevPtr = NULL;
-  char* ptr = *(heap_listp+index);
-  while (ptr != NULL) { 
-    if (GET_SIZE(ptr) >= asize) {
-      return ptr;
-    }
-    else {
-      prevPtr = ptr;
-      ptr = NEXT_FREE(ptr);   
-    }
+  int fl;
+  if (asize < SMALL_BLOCK)
+    return asize / ALIGNMENT;
+  fl = 8*sizeof(long) - 1 - __builtin_clzl(asize);
+  return ((fl - FL_SHIFT + 1) << SL_LOG2) + ((asize >> (fl - SL_LOG2)) ^ SL_COUNT);
+}
+
+/*
+ return the first list whose every block is at least asize: the
+ asize is rounded up to the next list boundary before it is mapped.
+ May return NBUCKETS or more when nothing could fit
+*/
+static int fitIndex(size_t asize) {
+  if (asize >= SMALL_BLOCK)
+    asize += (1UL << (8*sizeof(long) - 1 - __builtin_clzl(asize) - SL_LOG2)) - 1;
+  return getIndex(asize);
+}
+
+
+/* whether blocks of size are kept in order in arena a's lists */
+static inline int is_sorted(struct arena* a, unsigned int size) {
+  return a->fit != FIT_GOOD && size >= POLICY_MINSIZE;
+}
+
+/* the root of the index of the large list index */
+static inline char** tree_root(struct arena* a, int index) {
+  return &a->trees[index - (NBUCKETS - POLICY_LISTS)];
+}
+
+/*
+  count a first_fit that returns bp after looking at scan blocks
+*/
+static inline char* fit_stat(struct arena* a, char*bp, unsigned int scan) {
+  stat_add(bp != NULL ? &a->stats.fit_hit : &a->stats.fit_miss, 1);
+  if (scan > 0) {  //fit_scan[0] is whatever is left of the calls
+    int i = 8*sizeof(int) - __builtin_clz(scan);
+    stat_add(&a->stats.fit_scan[i < STAT_SCANS ? i : STAT_SCANS-1], 1);
   }
-  index++;
-  while (index <= 8) {
-    ptr = *(heap_listp+index);
-    if (ptr == NULL)
-      index++;
-    else {
-      prevPtr = NULL;
-      return ptr; 
+  return bp;
+}
+
+/*
+  return a free block of at least asize from the smallest
+  non-empty list that is sure to fit, or NULL if there is none.
+  The lists are found in the bitmaps, nothing is scanned
+*/
+static void* first_fit(struct arena* a, unsigned int asize) { 
+  int index = fitIndex(asize);
+  int fl;
+  unsigned int map;
+  unsigned int scan = 0;
+  if (is_sorted(a,asize)) {
+    /* the list asize maps to is sorted, its first fitting block is the
+       one the policy wants, found through the index. Any later list
+       fits whole, take its head */
+    char* bp;
+    index = getIndex(asize);
+    if (index < NBUCKETS) {
+      bp = *tree_root(a,index);
+      while (TREE_MAX(bp) >= asize) {
+        scan++;
+        if (TREE_MAX(TREE_LEFT(bp)) >= asize)
+          bp = TREE_LEFT(bp);
+        else if (GET_SIZE(bp) >= asize)
+          return fit_stat(a,bp,scan);
+        else
+          bp = TREE_RIGHT(bp);
+      }
     }
+    index++;
+  }
+  fl = index >> SL_LOG2;
+  if (fl >= FL_COUNT)
+    return fit_stat(a,NULL,scan);
+  map = a->sl_bitmap[fl] & (~0u << (index & (SL_COUNT-1)));
+  if (map == 0) {  //nothing left in this row, take the next row with a block
+    map = a->fl_bitmap & (~0u << (fl+1));
+    if (map == 0)
+      return fit_stat(a,NULL,scan);
+    fl = __builtin_ctz(map);
+    map = a->sl_bitmap[fl];
   }
-  return NULL;     
+  return fit_stat(a,a->buckets[(fl << SL_LOG2) + __builtin_ctz(map)],scan);
 }
 
 /*
   delete the free block, bp, from the seg free list that bp 
-  belongs to
+  belongs to. The list is doubly linked so this is O(1)
 */
-static void relink(char*bp, char*prev) {
-   int index = getIndex(GET_SIZE(bp));
+static void relink(struct arena* a, char*bp) {
+  char* prev = PREV_FREE(bp);
+  char* next = NEXT_FREE(bp);
+  int index = getIndex(GET_SIZE(bp));
+  if (is_sorted(a,GET_SIZE(bp)))
+    *tree_root(a,index) = tree_remove(a,*tree_root(a,index),bp);
   if (prev == NULL) {
-    *(index+heap_listp) = NEXT_FREE(bp);
+    a->buckets[index] = next;
+    if (next == NULL) {
+      int fl = index >> SL_LOG2;
+      a->sl_bitmap[fl] &= ~(1u << (index & (SL_COUNT-1)));
+      if (a->sl_bitmap[fl] == 0)
+        a->fl_bitmap &= ~(1u << fl);
+    }
+  }
+  else {
+    SET_NEXT(prev,next);
+  }
+  if (next != NULL)
+    SET_PREV(next,prev);
+}
+
+/*
+  whether the free block p goes before q in a sorted list
+*/
+static int sorts_before(struct arena* a, char*p, char*q) {
+  if (a->fit == FIT_BEST && GET_SIZE(p) != GET_SIZE(q))
+    return GET_SIZE(p) < GET_SIZE(q);
+  return p < q;  //by address, which also breaks ties between equal sizes
+}
+
+/* the treap's heap order: a hash of the block's address */
+static inline unsigned int tree_prio(char*p) {
+  return (unsigned int)(((size_t)p * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static inline void tree_fix(char*t) {
+  unsigned int max = GET_SIZE(t);
+  if (TREE_MAX(TREE_LEFT(t)) > max)
+    max = TREE_MAX(TREE_LEFT(t));
+  if (TREE_MAX(TREE_RIGHT(t)) > max)
+    max = TREE_MAX(TREE_RIGHT(t));
+  PUT((unsigned int *)(t+5*WSIZE),max);
+}
+
+/* lift t's right child above it, return the child */
+static char* rotate_left(char*t) {
+  char* r = TREE_RIGHT(t);
+  SET_RIGHT(t,TREE_LEFT(r));
+  SET_LEFT(r,t);
+  tree_fix(t);
+  tree_fix(r);
+  return r;
+}
+
+static char* rotate_right(char*t) {
+  char* l = TREE_LEFT(t);
+  SET_LEFT(t,TREE_RIGHT(l));
+  SET_RIGHT(l,t);
+  tree_fix(t);
+  tree_fix(l);
+  return l;
+}
+
+/*
+  add the free block bp to the subtree t and return its new root.
+  pred is set to the block bp goes after if it is in t
+*/
+static char* tree_insert(struct arena* a, char*t, char*bp, char** pred) {
+  if (t == NULL) {
+    SET_LEFT(bp,NULL);
+    SET_RIGHT(bp,NULL);
+    tree_fix(bp);
+    return bp;
+  }
+  if (sorts_before(a,t,bp)) {
+    *pred = t;
+    SET_RIGHT(t,tree_insert(a,TREE_RIGHT(t),bp,pred));
+    if (tree_prio(TREE_RIGHT(t)) > tree_prio(t))
+      return rotate_left(t);
   }
   else {
-    prev = prev + WSIZE;
-    *((char**)prev) = NEXT_FREE(bp);
+    SET_LEFT(t,tree_insert(a,TREE_LEFT(t),bp,pred));
+    if (tree_prio(TREE_LEFT(t)) > tree_prio(t))
+      return rotate_right(t);
+  }
+  tree_fix(t);
+  return t;
+}
+
+/*
+  take the free block bp out of the subtree t and return its new root.
+  bp is rotated down until it has a child at most, then spliced out
+*/
+static char* tree_remove(struct arena* a, char*t, char*bp) {
+  if (t == bp) {
+    if (TREE_LEFT(t) == NULL)
+      return TREE_RIGHT(t);
+    if (TREE_RIGHT(t) == NULL)
+      return TREE_LEFT(t);
+    if (tree_prio(TREE_LEFT(t)) > tree_prio(TREE_RIGHT(t))) {
+      t = rotate_right(t);
+      SET_RIGHT(t,tree_remove(a,TREE_RIGHT(t),bp));
+    }
+    else {
+      t = rotate_left(t);
+      SET_LEFT(t,tree_remove(a,TREE_LEFT(t),bp));
+    }
   }
+  else if (sorts_before(a,bp,t))
+    SET_LEFT(t,tree_remove(a,TREE_LEFT(t),bp));
+  else
+    SET_RIGHT(t,tree_remove(a,TREE_RIGHT(t),bp));
+  tree_fix(t);
+  return t;
+}
 
+/*
+  push the free block, bp, onto the head of the seg free list
+  that its size belongs to. Under an address or best fit policy large
+  blocks go into the list's index, which finds their place in order
+*/
+static void insert_free(struct arena* a, char*bp) {
+  int index = getIndex(GET_SIZE(bp));
+  char* nextFreeBlock = a->buckets[index];
+  char* prevFreeBlock = NULL;
+  if (is_sorted(a,GET_SIZE(bp))) {
+    *tree_root(a,index) = tree_insert(a,*tree_root(a,index),bp,&prevFreeBlock);
+    if (prevFreeBlock != NULL)
+      nextFreeBlock = NEXT_FREE(prevFreeBlock);
+  }
+  SET_NEXT(bp,nextFreeBlock);
+  SET_PREV(bp,prevFreeBlock);
+  if (nextFreeBlock != NULL)
+    SET_PREV(nextFreeBlock,bp);
+  if (prevFreeBlock != NULL) {
+    SET_NEXT(prevFreeBlock,bp);
+    return;
+  }
+  a->buckets[index] = bp;
+  a->sl_bitmap[index >> SL_LOG2] |= 1u << (index & (SL_COUNT-1));
+  a->fl_bitmap |= 1u << (index >> SL_LOG2);
 }
 
 
@@ -218,298 +1233,2291 @@ static void relink(char*bp, char*prev) {
   if possible, split the block and put the split block
   back into the seg free list
  */
-static char* place (unsigned int asize, char* bp, char*prev) { 
-  int csize = GET_SIZE(bp);
-  int diff = csize - asize;
-  if (diff > 2*DSIZE) {
+static char* place (struct arena* a, unsigned int asize, char* bp) { 
+  unsigned int csize = GET_SIZE(bp);
+  unsigned int diff = csize - asize;
+  unsigned int prev = GET(bp) & PREV_ALLOC;
+  if (diff >= MINSIZE) {
     char* newbp;
-    relink(bp,prev);
-    PUT((unsigned int *)bp,PACK(asize,1));
-    PUT((unsigned int *)FOOTER(bp),PACK(asize,1));
+    relink(a,bp);
+    PUT((unsigned int *)bp,PACK(asize,1) | prev);  //allocated blocks have no footer
     newbp = bp + asize;
-    PUT((unsigned int *)newbp,PACK(diff,0));
-    PUT((unsigned int*)FOOTER(newbp),PACK(diff,0));
-    free(newbp+WSIZE); 
+    PUT((unsigned int *)newbp,PACK(diff,0) | PREV_ALLOC);
+    free_block(a,newbp); 
   }
   else {
-    PUT((unsigned int *)bp,PACK(csize,1));
-    PUT((unsigned int *)FOOTER(bp),PACK(csize,1));
-    relink(bp,prev);
+    PUT((unsigned int *)bp,PACK(csize,1) | prev);
+    SET_PREV_ALLOC(bp + csize,1);
+    relink(a,bp);
   }
   return (bp+WSIZE); // so it points the payload
 }
 
- /* Malloc:
-    given a size, add 8 additonal bytes for header and footer.
-    search the seglist for a freeblock that fits the size. If no
-    blocks are found, extend the heap
- */
-void *malloc (size_t size) {
-  size_t asize;
+/*
+  like first_fit, but on a miss the quick lists are freed and coalesced
+  and the seg lists searched again, before anybody extends the heap
+*/
+static void* find_fit(struct arena* a, unsigned int asize) {
+  char*bp = first_fit(a,asize);
+  if (bp == NULL && a->nquick > 0) {
+    flush_quick(a);
+    bp = first_fit(a,asize);
+  }
+  return bp;
+}
+
+/*
+  take a block of exactly asize off the quick list, or else search the
+  seglist for a freeblock that fits asize. If no blocks are found,
+  extend the heap. Caller holds the arena lock
+*/
+static void* alloc_block(struct arena* a, unsigned int asize) {
   char*bp;
-  int index;
-  if (size == 0)
-    return NULL;
-  size += 8;
-  if (size %8 == 0)
-    asize = size;
-  else
-    asize = ((size/8)+1)*8;
-    //change the size to the mulitple of asize
-  index = getIndex(asize); //get the index to the right seg free list
-  bp = first_fit(asize,index);
-  if (bp == NULL) {
-    bp = extend_heap(asize);
+  drain_remote(a);
+  if (asize <= QL_MAXSIZE && (bp = a->quick[asize/ALIGNMENT]) != NULL) {
+    a->quick[asize/ALIGNMENT] = NEXT_OBJ(bp);
+    a->nquick--;
+    if (asize >= 2*MINSIZE)
+      UNTAG(bp);
     return bp;
   }
-  else {
-    return (place(asize,bp,prevPtr));
+  bp = find_fit(a,asize);
+  if (bp == NULL && (bp = extend_heap(a,asize,NULL)) == NULL)
+    return NULL;
+  return (place(a,asize,bp));
+}
+
+/*
+  give back a block the program freed. With lazy_coalesce it goes onto
+  the quick list of its size, still marked allocated so no neighbour
+  merges with it; otherwise it is freed and coalesced right away.
+  Caller holds the arena lock
+*/
+static void release_block(struct arena* a, char*bp) {
+  unsigned int size = GET_SIZE(bp);
+  if (!lazy_coalesce || size > QL_MAXSIZE) {
+    free_block(a,bp);
+    return;
   }
+  if (a->nquick >= QL_MAX)
+    flush_quick(a);
+  PUT((unsigned int *)bp,GET(bp) & ~SAMPLED);  //malloc hands it out as it is
+  SET_NEXT_OBJ(bp+WSIZE,a->quick[size/ALIGNMENT]);
+  if (size >= 2*MINSIZE)
+    TAG_FREE(bp+WSIZE);
+  a->quick[size/ALIGNMENT] = bp+WSIZE;
+  a->nquick++;
 }
 
 /*
-  find the prev pointer to the block, p
+  free and coalesce every block on the arena's quick lists in one pass.
+  Caller holds the arena lock
 */
-static void* find_prev(char* p) {
-  int index = getIndex(GET_SIZE(p));
-  prevPtr = NULL;
-  char* ptr = *(heap_listp+index);
-  while (ptr != p) { 
-    prevPtr = ptr;
-    ptr = NEXT_FREE(ptr);   
+static void flush_quick(struct arena* a) {
+  int i;
+  for (i = 0; i < QL_COUNT; i++) {
+    while (a->quick[i] != NULL) {
+      char* p = a->quick[i];
+      a->quick[i] = NEXT_OBJ(p);
+      free_block(a,p-WSIZE);
+    }
   }
-  return prevPtr;
+  a->nquick = 0;
 }
 
+/*
+  like alloc_block, but the payload is aligned to align (a power of two
+  no smaller than ALIGNMENT). The free block is split so the slop in front
+  of the payload goes back to the seg lists, and place() returns the slop
+  behind it. The slop in front is a multiple of ALIGNMENT, which is
+  MINSIZE, so it is always a block of its own. Caller holds the arena lock
+*/
+static void* alloc_aligned(struct arena* a, unsigned int asize, size_t align) {
+  unsigned int need = asize + align - ALIGNMENT;  //fits whatever the slop
+  unsigned int csize, lead;
+  char* bp;
+  char* nb;
+  drain_remote(a);
+  bp = first_fit(a,asize);  //try the block a plain malloc would get first
+  if (bp == NULL || ((-(size_t)(bp+WSIZE)) & (align-1)) + asize > GET_SIZE(bp))
+    bp = find_fit(a,need);
+  if (bp == NULL && (bp = extend_heap(a,need,NULL)) == NULL)
+    return NULL;
+  lead = (-(size_t)(bp+WSIZE)) & (align-1);
+  csize = GET_SIZE(bp);
+  if (lead == 0)
+    return place(a,asize,bp);
+  relink(a,bp);
+  PUT((unsigned int *)bp,PACK(lead,0) | (GET(bp) & PREV_ALLOC));
+  PUT((unsigned int *)FOOTER(bp),PACK(lead,0));
+  insert_free(a,bp);  //its left neighbour is allocated, nothing to merge
+  nb = bp + lead;
+  PUT((unsigned int *)nb,PACK(csize-lead,0));
+  PUT((unsigned int *)FOOTER(nb),PACK(csize-lead,0));
+  insert_free(a,nb);
+  return place(a,asize,nb);
+}
 
 /*
-   check if whether left or right block is free
-   if so, first use relink to 
-    delete that block and the current block, bp. 
-   then combine then and put it back to the seg list.
+  carve a page-aligned page out of the arena and set it up as an
+  empty slab of class cls. Caller holds the arena lock
 */
+static struct slab* new_slab(struct arena* a, int cls) {
+  struct slab* s = alloc_aligned(a, PAGE_SIZE + ALIGNMENT, PAGE_SIZE);
+  if (s == NULL)
+    return NULL;
+  page_owner[page_index((char*)s)] |= PAGE_SLAB;
+  s->next = a->slabs[cls];
+  s->prev = NULL;
+  if (s->next != NULL)
+    s->next->prev = s;
+  a->slabs[cls] = s;
+  s->free = NULL;
+  s->bump = (char*)s + SLAB_HDR;
+  s->cls = cls;
+  s->nobj = (PAGE_SIZE - SLAB_HDR) / slab_size(cls);
+  s->nfree = s->nobj;
+  return s;
+}
 
-static void coalesce(char*bp) {
-  int leftAlloc = GET_ALLOC(bp - WSIZE);
+/*
+  take one object of class cls from the arena's slabs. Caller holds
+  the arena lock
+*/
+static void* slab_alloc(struct arena* a, int cls) {
+  struct slab* s = a->slabs[cls];
+  char* p;
+  if (s == NULL && (s = new_slab(a, cls)) == NULL)
+    return NULL;
+  if (s->free != NULL) {
+    p = s->free;
+    s->free = NEXT_OBJ(p);
+    UNTAG(p);
+  }
+  else {
+    p = s->bump;
+    s->bump += slab_size(cls);
+  }
+  if (--s->nfree == 0) {  //full, it leaves the partial list
+    a->slabs[cls] = s->next;
+    if (s->next != NULL)
+      s->next->prev = NULL;
+  }
+  return p;
+}
+
+/*
+  put the object p back into its slab. A slab that becomes empty is
+  freed as a block unless it is the only one of its class with room.
+  Caller holds the arena lock
+*/
+static void slab_free(struct arena* a, char*p) {
+  struct slab* s = slab_of(p);
+  int cls = s->cls;
+  SET_NEXT_OBJ(p,s->free);
+  TAG_FREE(p);
+  s->free = p;
+  if (s->nfree++ == 0) {  //was full, back on the partial list
+    s->next = a->slabs[cls];
+    s->prev = NULL;
+    if (s->next != NULL)
+      s->next->prev = s;
+    a->slabs[cls] = s;
+    return;
+  }
+  if (s->nfree < s->nobj || (s->prev == NULL && s->next == NULL))
+    return;
+  if (s->prev != NULL)
+    s->prev->next = s->next;
+  else
+    a->slabs[cls] = s->next;
+  if (s->next != NULL)
+    s->next->prev = s->prev;
+  page_owner[page_index((char*)s)] &= ~PAGE_SLAB;
+  free_block(a,(char*)s - WSIZE);
+}
+
+/*
+  free the payload pointer p, a slab object or a block, into arena a.
+  Caller holds the arena lock
+*/
+static void free_local(struct arena* a, char*p) {
+  if (is_slab(p))
+    slab_free(a,p);
+  else
+    release_block(a,p-WSIZE);
+}
+
+/*
+  return the number of bytes the caller may use at the payload p
+*/
+static size_t usable_size(char*p) {
+  if (is_mapped(p))
+    return *(size_t*)(p - MAP_HDR) - (p - map_start(p));
+  if (is_slab(p))
+    return slab_size(slab_of(p)->cls);
+  return GET_SIZE(p-WSIZE) - WSIZE;
+}
+
+/*
+  give the request its own mapping, with the payload aligned to align
+  and the mapped length in the header in front of it. Alignments above
+  a page are found by mapping more and unmapping the slop on either side
+*/
+static void* mmap_alloc(size_t size, size_t align) {
+  size_t off = align > PAGE_SIZE ? PAGE_SIZE : (align < MAP_HDR ? MAP_HDR : align);
+  size_t extra = align > PAGE_SIZE ? align - PAGE_SIZE : 0;
+  size_t len = (size + off + PAGE_SIZE-1) & ~(PAGE_SIZE-1);
+  char* map;
+  char* p;
+  if (len < size || len + extra < len)
+    return NULL;  //overflowed
+  map = mmap(NULL, len + extra, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED)
+    return NULL;
+  p = (char*)(((size_t)map + off + align-1) & ~(align-1));
+  if (p - off > map)
+    munmap(map, p - off - map);
+  if (map + len + extra > p - off + len)
+    munmap(p - off + len, map + len + extra - (p - off + len));
+  if (huge_pages && len >= HUGE_PAGE_SIZE)
+    madvise(p - off, len, MADV_HUGEPAGE);
+  *(size_t*)(p - MAP_HDR) = len;
+  stat_size(&mapped_size, &mapped_peak, len);
+  return p;
+}
+
+/*
+  resize the mapping of p with mremap, letting the kernel move it
+  rather than copying the contents. The payload keeps its offset in
+  the first page
+*/
+static void* mmap_realloc(char*p, size_t size) {
+  char* map = map_start(p);
+  size_t off = p - map;
+  size_t len = (size + off + PAGE_SIZE-1) & ~(PAGE_SIZE-1);
+  if (len < size)
+    return NULL;
+  if (len == *(size_t*)(p - MAP_HDR))
+    return p;
+  map = mremap(map, *(size_t*)(p - MAP_HDR), len, MREMAP_MAYMOVE);
+  if (map == MAP_FAILED)
+    return NULL;
+  stat_size(&mapped_size, &mapped_peak, len - *(size_t*)(map + off - MAP_HDR));
+  *(size_t*)(map + off - MAP_HDR) = len;
+  return map + off;
+}
+
+/*
+  return the block size that holds a request of size bytes: 4 bytes
+  for the header, rounded up to ALIGNMENT, at least MINSIZE
+*/
+static size_t block_size(size_t size) {
+  size_t asize = ALIGN(size + WSIZE);
+  return asize < MINSIZE ? MINSIZE : asize; //a free block has to hold both links
+}
+
+/*
+  try to resize the allocation at p without moving it. A slab object
+  stays if the new size is in the same class. A block shrinks by
+  splitting off its tail, or grows into a free right neighbour and,
+  when that leads to the top of the arena's region, into fresh heap
+  for just the shortfall. Return NULL if the data has to move
+*/
+static void* realloc_in_place(char*p, size_t size) {
+  char* bp = p - WSIZE;
+  char* next;
+  char* after;
+  struct arena* a;
+  unsigned int asize, csize, avail;
+  if (is_slab(p))
+    return (size <= SLAB_MAXSIZE && slab_class(size) == slab_of(p)->cls) ? p : NULL;
+  if (size <= SLAB_MAXSIZE || size >= mmap_threshold)
+    return NULL;  //belongs in a slab or a mapping now
+  asize = block_size(size);
+  a = arena_of(p);
+  pthread_mutex_lock(&a->lock);
+  csize = GET_SIZE(bp);
+  next = bp + csize;
+  avail = csize;
+  after = next;
+  if (GET_ALLOC(next) == 0) {
+    avail += GET_SIZE(next);
+    after = next + GET_SIZE(next);
+  }
+  if (avail < asize && after == a->top) {
+    size_t want = asize - avail < MINSIZE ? MINSIZE : asize - avail;
+    size_t room = a->end - a->top - WSIZE;
+    if (room >= want || grow_arena(a, want - room, 1) == 0) {
+      take_reserve(a,NULL);  //merges with next if that was free
+      next = bp + csize;
+      avail = csize + GET_SIZE(next);
+    }
+  }
+  if (avail < asize) {
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+  }
+  if (GET_ALLOC(next) == 0)
+    relink(a,next);
+  check_merged(a, bp, bp + avail);
+  if (avail - asize >= MINSIZE) {  //split off the tail like place() does
+    char* tail = bp + asize;
+    PUT((unsigned int *)bp,PACK(asize,1) | (GET(bp) & PREV_ALLOC));
+    PUT((unsigned int *)tail,PACK(avail-asize,1) | PREV_ALLOC);
+    free_block(a,tail);
+  }
+  else {
+    PUT((unsigned int *)bp,PACK(avail,1) | (GET(bp) & PREV_ALLOC));
+    SET_PREV_ALLOC(bp + avail,1);
+  }
+  pthread_mutex_unlock(&a->lock);
+  return p;
+}
+
+/*
+  return the arena that owns the block or slab object, bp
+*/
+static struct arena* arena_of(char*bp) {
+  return &arenas[(page_owner[page_index(bp)] & ~PAGE_SLAB) - 1];
+}
+
+/*
+  return the calling thread's arena, the one of the cpu it first ran on
+*/
+static struct arena* thread_arena(struct tcache* tc) {
+  if (tc->arena == NULL) {
+    int cpu = sched_getcpu();
+    unsigned int c, node;
+    assert(narenas > 0);  //malloc before mm_init
+    tc->arena = &arenas[(cpu < 0 ? 0 : cpu) % narenas];
+    if (numa && tc->arena->node == 0 && syscall(SYS_getcpu, &c, &node, NULL) == 0)
+      __atomic_store_n(&tc->arena->node, node + 1, __ATOMIC_RELAXED);
+  }
+  return tc->arena;
+}
+
+/*
+  lock and return an arena for the calling thread: its own, or a
+  neighbour if that one is busy right now
+*/
+static struct arena* lock_arena(struct tcache* tc) {
+  struct arena* a = thread_arena(tc);
+  int i;
+  if (pthread_mutex_trylock(&a->lock) == 0)
+    return a;
+  for (i = 1; i <= ARENA_PROBES && i < narenas; i++) {
+    struct arena* b = &arenas[(a - arenas + i) % narenas];
+    if (pthread_mutex_trylock(&b->lock) == 0)
+      return b;
+  }
+  pthread_mutex_lock(&a->lock);
+  return a;
+}
+
+/*
+  hand the payload pointer, p, to arena a without taking its lock
+*/
+static void remote_free(struct arena* a, char*p) {
+  char* head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+  do {
+    SET_NEXT_OBJ(p,head);
+  } while (!__atomic_compare_exchange_n(&a->remote, &head, p, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+  free everything other threads queued on arena a. Caller holds the
+  arena lock, so it is the only one taking the list
+*/
+static void drain_remote(struct arena* a) {
+  char* p;
+  if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED) == NULL)
+    return;
+  p = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+  while (p != NULL) {
+    char* next = NEXT_OBJ(p);
+    free_local(a,p);
+    p = next;
+  }
+}
+
+/*
+  return the calling thread's cache, emptying it first if it still
+  holds blocks from a heap that mm_init has since thrown away
+*/
+static struct tcache* get_tcache(void) {
+  struct tcache* tc = &tcache;
+  if (tc->gen != heap_gen) {
+    memset(&tc->gen, 0, sizeof(*tc) - offsetof(struct tcache, gen));
+    __atomic_store_n(&tc->gen, heap_gen, __ATOMIC_RELAXED);
+    if (tc->released)
+      return tc;  //a later destructor, it caches nothing and stays off the list
+    tc->limit = TC_MAX;
+    pthread_setspecific(tcache_key, tc);
+    if (tc->pprev == NULL) {  //first use, let the stats readers find it
+      pthread_mutex_lock(&stats_lock);
+      tc->next = threads;
+      if (threads != NULL)
+        threads->pprev = &tc->next;
+      threads = tc;
+      tc->pprev = &threads;
+      pthread_mutex_unlock(&stats_lock);
+    }
+  }
+  return tc;
+}
+
+/*
+  the bin is empty: refill it under a single lock and return one
+  object. Slab bins take TC_FILL objects from the slabs; block bins
+  carve TC_FILL blocks of asize out of one free block, and the last
+  one, which is returned, also takes any slack place() left. A released
+  cache only gets the one object
+*/
+static void* tcache_refill(struct tcache* tc, int bin, unsigned int asize) {
+  unsigned int n = tc->limit != 0 ? TC_FILL : 1;
+  unsigned int i;
+  char* bp;
+  struct arena* a;
+  stat_add(&tc->stats.nmalloc[bin], 1);  //the one returned never was in the bin
+  a = lock_arena(tc);
+  if (bin < NSLAB) {
+    drain_remote(a);
+    bp = slab_alloc(a,bin);
+    for (i = 1; i < n && bp != NULL; i++) {
+      char* p = slab_alloc(a,bin);
+      if (p == NULL)
+        break;
+      SET_NEXT_OBJ(p,tc->bins[bin]);
+      TAG_FREE(p);
+      tc->bins[bin] = p;
+      tc->nin[bin]++;
+      tc->nfill[bin]++;
+    }
+    pthread_mutex_unlock(&a->lock);
+    return bp;
+  }
+  bp = alloc_block(a,n*asize);
+  if (bp == NULL) {
+    n = 1;
+    bp = alloc_block(a,asize);
+  }
+  if (bp == NULL) {
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+  }
+  bp = bp - WSIZE; //so it points at the head
+  split_run(bp,asize,n);
+  for (i = 0; i+1 < n; i++) {
+    SET_NEXT_OBJ(bp+WSIZE,tc->bins[bin]);
+    TAG_FREE(bp+WSIZE);
+    tc->bins[bin] = bp+WSIZE;
+    tc->nin[bin]++;
+    tc->nfill[bin]++;
+    bp = bp + asize;
+  }
+  pthread_mutex_unlock(&a->lock);
+  return (bp+WSIZE);
+}
+
+/*
+  cut the allocated block bp into n allocated blocks of asize, the last
+  one keeping whatever is left over
+*/
+static void split_run(char*bp, unsigned int asize, unsigned int n) {
+  unsigned int last = GET_SIZE(bp) - (n-1)*asize;
+  unsigned int prev = GET(bp) & PREV_ALLOC;
+  unsigned int i;
+  for (i = 0; i+1 < n; i++) {
+    PUT((unsigned int*)bp,PACK(asize,1) | prev);
+    bp = bp + asize;
+    prev = PREV_ALLOC;
+  }
+  PUT((unsigned int*)bp,PACK(last,1) | prev);
+}
+
+/*
+  give n objects of the bin back to the arenas that own them. Objects
+  of the thread's own arena are freed under one lock, the others are
+  queued on their arena's remote list
+*/
+static void tcache_flush(struct tcache* tc, int bin, unsigned int n) {
+  struct arena* home = thread_arena(tc);
+  int locked = 0;
+  while (n > 0 && tc->bins[bin] != NULL) {
+    char* p = tc->bins[bin];
+    struct arena* a = arena_of(p);
+    tc->bins[bin] = NEXT_OBJ(p);
+    tc->nin[bin]--;
+    tc->nfill[bin]--;
+    n--;
+    if (a != home) {
+      remote_free(a,p);
+      continue;
+    }
+    if (!locked) {
+      pthread_mutex_lock(&home->lock);
+      drain_remote(home);
+      locked = 1;
+    }
+    free_local(home,p);
+  }
+  if (locked)
+    pthread_mutex_unlock(&home->lock);
+}
+
+/*
+  cache the object p in the bin, flushing half the bin when it is full.
+  A released cache holds nothing, p goes straight back to its arena
+*/
+static inline void tcache_put(struct tcache* tc, int bin, char*p) {
+  SET_NEXT_OBJ(p,tc->bins[bin]);
+  TAG_FREE(p);
+  tc->bins[bin] = p;
+  if (++tc->nin[bin] - tc->nmalloc[bin] > tc->limit)
+    tcache_flush(tc, bin, tc->limit != 0 ? TC_MAX/2 : bin_count(tc, bin));
+}
+
+/*
+  pthread key destructor: hand everything a dying thread cached back.
+  Destructors that run after it may still malloc and free, the cache
+  passes their objects on instead of keeping them
+*/
+static void tcache_release(void* arg) {
+  struct tcache* tc = arg;
+  int bin;
+  unsigned int i;
+  tc->released = 1;
+  tc->limit = 0;
+  pthread_mutex_lock(&stats_lock);
+  if (tc->gen == heap_gen) {  //keep its counts
+    for (bin = 0; bin < TC_BINS && MM_STATS; bin++) {
+      retired.nmalloc[bin] += tc->nmalloc[bin];
+      retired.nfree[bin] += tc->nin[bin] - tc->nfill[bin];
+    }
+    for (i = 0; i < sizeof(retired)/sizeof(unsigned long); i++)
+      ((unsigned long*)&retired)[i] += ((unsigned long*)&tc->stats)[i];
+  }
+  if (tc->pprev != NULL) {
+    *tc->pprev = tc->next;
+    if (tc->next != NULL)
+      tc->next->pprev = tc->pprev;
+    tc->pprev = NULL;
+  }
+  pthread_mutex_unlock(&stats_lock);
+  if (tc->ring != NULL) {  //off the list, the flusher won't see it again
+    pthread_mutex_lock(&trace_lock);
+    trace_drain(tc->ring);
+    pthread_mutex_unlock(&trace_lock);
+    munmap(tc->ring, sizeof(struct trace_ring));
+    tc->ring = NULL;
+  }
+  if (tc->gen != heap_gen)
+    return;
+  for (bin = 0; bin < TC_BINS; bin++)
+    if (tc->bins[bin] != NULL)
+      tcache_flush(tc, bin, bin_count(tc, bin));
+}
+
+static void tcache_key_init(void) {
+  pthread_key_create(&tcache_key, tcache_release);
+}
+
+ /* Malloc:
+    sizes up to SLAB_MAXSIZE get a slab object and sizes from
+    mmap_threshold up their own mapping. Otherwise block_size adds
+    4 additonal bytes for the header. Small sizes are served from the
+    thread cache, everything else goes to the seg lists of the
+    thread's arena
+ */
+static inline __attribute__((always_inline)) void* do_malloc(size_t size) {
+  size_t asize;
+  char*bp;
+  struct tcache* tc;
+  int bin;
+  if (size == 0)
+    return NULL;
+  tc = get_tcache();
+  if ((tc->prof_left -= size) < 0 && (bp = prof_alloc(tc, size)) != NULL)
+    return bp;
+  if (size <= SLAB_MAXSIZE) {
+    bin = slab_class(size);
+    if ((bp = tc->bins[bin]) == NULL)
+      return tcache_refill(tc, bin, slab_size(bin));
+    tc->bins[bin] = NEXT_OBJ(bp);
+    tc->nmalloc[bin]++;
+    UNTAG(bp);
+    return bp;
+  }
+  if (size >= mmap_threshold) {
+    stat_add(&tc->stats.nmap, 1);
+    return mmap_alloc(size, ALIGNMENT);
+  }
+  asize = block_size(size);
+  bin = block_class(asize);
+  if (asize <= TC_MAXSIZE) {
+    if ((bp = tc->bins[bin]) == NULL)
+      return tcache_refill(tc, bin, asize);
+    tc->bins[bin] = NEXT_OBJ(bp);
+    tc->nmalloc[bin]++;
+    UNTAG(bp);
+    return bp;
+  }
+  stat_add(&tc->stats.nmalloc[bin], 1);
+  struct arena* a = lock_arena(tc);
+  bp = alloc_block(a,asize);
+  pthread_mutex_unlock(&a->lock);
+  return bp;
+}
+
+void *malloc (size_t size) {
+  void* p = do_malloc(size);
+  if (trace_on)
+    trace_op('a', p, NULL, size, 0);
+  return p;
+}
+
+/*
+   check if whether left or right block is free
+   if so, first use relink to 
+    delete that block and the current block, bp. 
+   then combine then and put it back to the seg list.
+   return the header of the resulting free block. The left neighbour
+   is found through its footer, which only free blocks have, so the
+   PREV_ALLOC bit in bp's header tells whether there is one
+*/
+
+static char* coalesce(struct arena* a, char*bp) {
+  int leftAlloc = GET_PREV_ALLOC(bp);
   int rightAlloc = GET_ALLOC(bp+ GET_SIZE(bp));
   char* rightBlock;
-  char* leftBlock;
-  int newSize;
+  char* leftBlock = bp;
+  unsigned int newSize;
   if (leftAlloc == 1 && rightAlloc ==1)  /* case 1 do not coalesce*/
-    return;
+    ;
   else if (leftAlloc ==0 && rightAlloc == 1) { /* case 2 coalesce leftblock */
     leftBlock = bp - GET_SIZE(bp-WSIZE);
-    relink(bp,NULL);
-    relink(leftBlock,find_prev(leftBlock));	 /* case 3 coalesce rightblock*/
+    relink(a,bp);
+    relink(a,leftBlock);
     newSize = GET_SIZE(leftBlock) + GET_SIZE(bp);
-    PUT((unsigned int *)leftBlock,PACK(newSize,0));
+    PUT((unsigned int *)leftBlock,PACK(newSize,0) | PREV_ALLOC);
     PUT((unsigned int*)FOOTER(leftBlock),PACK(newSize,0));
-    char * nextFreeBlock = *(getIndex(GET_SIZE(leftBlock)) + heap_listp); /* put new block into seg list*/
-    *(getIndex(GET_SIZE(leftBlock))+heap_listp) = leftBlock;
-    *((char**)(leftBlock+WSIZE)) = nextFreeBlock;
-    
+    insert_free(a,leftBlock); /* put new block into seg list*/
   }
   else if (leftAlloc ==1 && rightAlloc == 0) { /*case 3 coalesce rightblock*/
     rightBlock = bp + GET_SIZE(bp);
-    relink(bp,NULL);
-    relink(rightBlock,find_prev(rightBlock));
+    relink(a,bp);
+    relink(a,rightBlock);
     newSize = GET_SIZE(rightBlock) + GET_SIZE(bp);
-    PUT((unsigned int *)bp,PACK(newSize,0));
+    PUT((unsigned int *)bp,PACK(newSize,0) | PREV_ALLOC);
     PUT((unsigned int*)FOOTER(bp),PACK(newSize,0));
-    char * nextFreeBlock = *(getIndex(GET_SIZE(bp)) + heap_listp);  /* put new block into seg list*/
-    *(getIndex(GET_SIZE(bp))+heap_listp) = bp;
-    *((char**)(bp+WSIZE)) = nextFreeBlock;
+    insert_free(a,bp);  /* put new block into seg list*/
   }
   else {
     rightBlock = bp + GET_SIZE(bp); /* case 4 coalesce left and right block*/
     leftBlock = bp - GET_SIZE(bp-WSIZE);
-    relink(bp,NULL);
-    relink(rightBlock,find_prev(rightBlock));
-    relink(leftBlock,find_prev(leftBlock));
+    relink(a,bp);
+    relink(a,rightBlock);
+    relink(a,leftBlock);
     newSize = GET_SIZE(rightBlock) + GET_SIZE(bp) + GET_SIZE(leftBlock);
-    PUT((unsigned int *)leftBlock,PACK(newSize,0));
+    PUT((unsigned int *)leftBlock,PACK(newSize,0) | PREV_ALLOC);
     PUT((unsigned int*)FOOTER(leftBlock),PACK(newSize,0));
-    char * nextFreeBlock = *(getIndex(GET_SIZE(leftBlock)) + heap_listp); /* put new block into seg list*/
-    *(getIndex(GET_SIZE(leftBlock))+heap_listp) = leftBlock;
-    *((char**)(leftBlock+WSIZE)) = nextFreeBlock;    
+    insert_free(a,leftBlock); /* put new block into seg list*/
   } 
-  return;
+  stat_add(&a->stats.ncoalesce[(!leftAlloc) | (!rightAlloc) << 1], 1);
+  check_merged(a, leftBlock, leftBlock + GET_SIZE(leftBlock));
+  SET_PREV_ALLOC(leftBlock + GET_SIZE(leftBlock),0);
+  return leftBlock;
+}
+
+
+/*
+  free the allocated block, bp, and coalesce it. Caller holds the
+  arena lock
+*/
+static void free_block(struct arena* a, char*bp) {
+  unsigned int size = GET_SIZE(bp);
+  PUT((unsigned int *)bp,PACK(size,0) | (GET(bp) & PREV_ALLOC));  /*free the block*/
+  PUT((unsigned int *)FOOTER(bp),PACK(size,0));
+ 
+  insert_free(a,bp); /*put into the seg list*/
+  bp = coalesce(a,bp);
+  if (purge_threshold != 0 && GET_SIZE(bp) >= purge_threshold) {
+    a->dirty += size;
+    if (a->dirty >= purge_threshold)
+      maybe_purge(a);
+  }
+}
+
+/*
+  purge the arena unless it was purged less than purge_interval ms
+  ago. Caller holds the arena lock
+*/
+static void maybe_purge(struct arena* a) {
+  struct timespec ts;
+  long now;
+  int index;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  now = ts.tv_sec*1000 + ts.tv_nsec/1000000;
+  if (now - a->last_purge < (long)purge_interval)
+    return;
+  a->last_purge = now;
+  a->dirty = 0;
+  trim_top(a);
+  for (index = getIndex(purge_threshold); index < NBUCKETS; index++) {
+    char* ptr;
+    if (!(a->sl_bitmap[index >> SL_LOG2] & (1u << (index & (SL_COUNT-1)))))
+      continue;
+    for (ptr = a->buckets[index]; ptr != NULL; ptr = NEXT_FREE(ptr))
+      if (!(GET(ptr) & PURGED) && GET_SIZE(ptr) >= purge_threshold)
+        purge_block(ptr);
+  }
+}
+
+/*
+  release the pages inside the free block, bp, keeping the header,
+  the list and index links and the footer resident
+*/
+static void purge_block(char*bp) {
+  size_t unit = huge_pages ? HUGE_PAGE_SIZE : PAGE_SIZE;  //never split a huge page
+  char* lo = (char*)(((size_t)bp + TREE_HDR + unit-1) & ~(unit-1));
+  char* hi = (char*)((size_t)FOOTER(bp) & ~(unit-1));
+  if (lo < hi)
+    madvise(lo, hi - lo, purge_lazy ? MADV_FREE : MADV_DONTNEED);
+  PUT((unsigned int *)bp,GET(bp) | PURGED);
 }
 
+/*
+  if the last block of the arena's current region is a large free
+  block, hand it back to the region's unused reserve and release its
+  pages. Caller holds the arena lock
+*/
+static void trim_top(struct arena* a) {
+  char* bp;
+  char* lo;
+  if (a->top == NULL || GET_PREV_ALLOC(a->top))
+    return;
+  bp = a->top - GET_SIZE(a->top - WSIZE);
+  if (GET_SIZE(bp) < purge_threshold)
+    return;
+  relink(a,bp);
+  stat_size(&heap_size, &heap_peak, -(long)GET_SIZE(bp));
+  a->top = bp;
+  check_merged(a, bp, a->end);  //the walk ends at the new epilogue
+  a->chunk = grow_chunk;  //the arena shrank, start over with small chunks
+  PUT((unsigned int *)bp,PACK(0,1) | PREV_ALLOC);  /* new epilogue */
+  lo = (char*)(((size_t)bp + WSIZE + PAGE_SIZE-1) & ~(PAGE_SIZE-1));
+  if (huge_pages)  //the huge page around the epilogue stays whole
+    lo = (char*)(((size_t)lo + HUGE_PAGE_SIZE-1) & ~(HUGE_PAGE_SIZE-1));
+  if (lo < a->end) {
+    madvise(lo, a->end - lo, purge_lazy ? MADV_FREE : MADV_DONTNEED);
+    if (!purge_lazy && SBRK_ZEROED && (a->clean == NULL || lo < a->clean))
+      a->clean = lo;  //released pages read as zero again
+  }
+}
 
 /* Free:
- * free the allocated block and coalesce the free block 
+ * slab objects and small blocks go to the thread cache, the rest
+ * are freed and coalesced in the seg lists of the arena that owns
+ * them, or queued for it if that is not the thread's arena. A sampled
+ * block skips the cache, its flag goes under the owner's lock
  */
-void free (void *ptr) {
-  
+static inline __attribute__((always_inline)) void do_free(void *ptr) {
+  char* bp;
+  unsigned int size;
+  int bin, sampled = 0;
+  struct tcache* tc;
   if(!ptr) return;
-  ptr = ptr- WSIZE;  //so it points at the head
-  PUT((unsigned int *)ptr,PACK(GET_SIZE(ptr),0));        /*free the block*/
-  PUT((unsigned int *)FOOTER(ptr),PACK(GET_SIZE(ptr),0));
- 
-  int size = GET_SIZE(ptr);
-  char* nextFreeBlock = *(getIndex(size) + heap_listp); /*put into the seg list*/
-  *((char**)(ptr+WSIZE)) = nextFreeBlock;
-  *(getIndex(size) + heap_listp) = ptr;
-  
-  coalesce(ptr);
+  bp = (char*)ptr - WSIZE;  //so it points at the head
+  tc = get_tcache();
+  if (MM_HARDEN) {
+    harden_free(tc, ptr);
+    if (poison)
+      poison_payload(ptr);
+  }
+  if (is_mapped(ptr)) {
+    if (__atomic_load_n(&prof_live, __ATOMIC_RELAXED) != 0)
+      prof_drop(ptr);
+    stat_add(&tc->stats.nunmap, 1);
+    stat_size(&mapped_size, &mapped_peak, -(long)*(size_t*)((char*)ptr - MAP_HDR));
+    munmap(map_start(ptr), *(size_t*)((char*)ptr - MAP_HDR));
+    return;
+  }
+  if (is_slab(ptr)) {
+    bin = slab_of(ptr)->cls;
+  }
+  else {
+    if (GET(bp) & SAMPLED) {
+      prof_drop(ptr);
+      sampled = 1;
+    }
+    if (MM_HARDEN && GET_ALLOC(bp) == 0)  //harden_free may not have looked
+      harden_fail("double free", ptr);
+    size = GET_SIZE(bp);
+    bin = size > SLAB_MAXSIZE ? block_class(size) : TC_BINS;  //TC_BINS is never cached
+  }
+  if (bin < TC_BINS && !sampled) {
+    tcache_put(tc, bin, ptr);
+    return;
+  }
+  stat_add(&tc->stats.nfree[bin], 1);
+  struct arena* a = arena_of(bp);
+  if (a != thread_arena(tc)) {
+    remote_free(a,ptr);
+    return;
+  }
+  pthread_mutex_lock(&a->lock);
+  drain_remote(a);
+  release_block(a,bp);
+  pthread_mutex_unlock(&a->lock);
   return;
 }
 
+void free (void *ptr) {
+  if (trace_on && ptr != NULL)
+    trace_op('f', ptr, NULL, 0, 0);  //before the block can be reused
+  do_free(ptr);
+}
+
 /* Realloc:
- * increases the size of the specified block of memory. Reallocates it if needed
+ * increases the size of the specified block of memory. Reallocates it if needed.
+ * A mapping that stays above mmap_threshold is resized in place with mremap;
+ * a heap block is resized in place whenever realloc_in_place manages to.
+ * When a block moves, the trace record is stamped once the new block is
+ * ours and before the old one can be handed out again
  */
-void *realloc(void *oldptr, size_t size) {
+static inline __attribute__((always_inline)) void* do_realloc(void *oldptr, size_t size, unsigned long* when) {
    char *bp;
-  unsigned int oldsize;
+  size_t oldsize;
   if (oldptr == NULL) {
-	bp = malloc(size);
+	bp = do_malloc(size);
 	return bp;
   }
+  if (MM_HARDEN)
+    check_ptr(get_tcache(), oldptr);
   if (size == 0) {
-    free(oldptr);  
+    do_free(oldptr);  
     return NULL;
   }
+  if (is_mapped(oldptr)) {
+    if (size >= mmap_threshold &&
+        (__atomic_load_n(&prof_live, __ATOMIC_RELAXED) == 0 || !prof_sampled(oldptr)))
+      return mmap_realloc(oldptr, size);  //a sampled mapping moves like a block
+  }
+  else if ((is_slab(oldptr) || !(GET((char*)oldptr - WSIZE) & SAMPLED)) &&
+           (bp = realloc_in_place(oldptr, size)) != NULL)
+    return bp;  //a sampled block moves, so free() drops its record
   /*find new block of appropriate size */
-  bp = malloc(size);
+  bp = do_malloc(size);
   if (bp == NULL)
 	return 0;
-  oldsize = GET_SIZE(oldptr - WSIZE);
+  oldsize = usable_size(oldptr);
   if (oldsize > size)
     oldsize = size;
   /* copy necessary memory into new block */
   memcpy(bp, oldptr, oldsize);
+  if (trace_on)
+    *when = trace_clock();
   /* free old block */
-  free(oldptr);
+  do_free(oldptr);
   return bp;
 }
 
+void *realloc(void *oldptr, size_t size) {
+  unsigned long when = trace_on ? trace_clock() : 0;  //before the old block can be reused
+  void* p = do_realloc(oldptr, size, &when);
+  if (trace_on)
+    trace_op('r', p, oldptr, size, when);
+  return p;
+}
+
 /* Calloc:
- * 
- * allocates the specified number of bytes and initializes them to zero
- * 
+ * allocates nmemb*size bytes and initializes them to zero, or returns
+ * NULL with ENOMEM if the product overflows. Mappings are zero already
+ * and sizes the thread cache serves are cleared with memset. A larger
+ * block carved from reserve that was never used, which reads as zero
+ * when SBRK_ZEROED is set, is only cleared below the arena's clean mark
  */
-void *calloc (size_t nmemb, size_t size) {
-    size_t bytes = nmemb * size;
-    void *newptr;
-    newptr = malloc(bytes);
-    /* set all bytes to zero */
-    memset(newptr, 0, bytes);
-    return newptr;
+static inline __attribute__((always_inline)) void* do_calloc(size_t nmemb, size_t size) {
+  size_t bytes, asize;
+  char* zero = NULL;
+  char* bp;
+  char* p;
+  struct tcache* tc;
+  struct arena* a;
+  if (__builtin_mul_overflow(nmemb, size, &bytes)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (bytes >= mmap_threshold || (bytes > SLAB_MAXSIZE && block_size(bytes) > TC_MAXSIZE)) {
+    tc = get_tcache();  //the other sizes are sampled by malloc
+    if ((tc->prof_left -= bytes) < 0 && (p = prof_alloc(tc, bytes)) != NULL) {
+      if (!is_mapped(p))
+        zero_bytes(p, bytes);
+      return p;
+    }
+  }
+  if (bytes >= mmap_threshold) {
+    stat_add(&get_tcache()->stats.nmap, 1);
+    return mmap_alloc(bytes, ALIGNMENT);
   }
+  if (bytes <= SLAB_MAXSIZE || block_size(bytes) <= TC_MAXSIZE) {
+    p = do_malloc(bytes);
+    if (p != NULL)
+      memset(p, 0, bytes);
+    return p;
+  }
+  asize = block_size(bytes);
+  tc = get_tcache();
+  stat_add(&tc->stats.nmalloc[block_class(asize)], 1);
+  a = lock_arena(tc);
+  drain_remote(a);
+  bp = find_fit(a,asize);
+  if (bp == NULL && (bp = extend_heap(a,asize,&zero)) != NULL && zero != NULL)
+    PUT((unsigned int *)FOOTER(bp),0);  //the one word written above zero
+  p = bp == NULL ? NULL : place(a,asize,bp);
+  pthread_mutex_unlock(&a->lock);
+  if (p == NULL)
+    return NULL;
+  if (zero == NULL || (size_t)(zero - p) > bytes)
+    zero_bytes(p, bytes);
+  else if (zero > p)
+    zero_bytes(p, zero - p);
+  return p;
+}
 
+void *calloc (size_t nmemb, size_t size) {
+  void* p = do_calloc(nmemb, size);
+  if (trace_on)
+    trace_op('c', p, NULL, nmemb*size, 0);
+  return p;
+}
 
 /*
- * Return whether the pointer is in the heap.
- * May be useful for debugging.
- */
-static int in_heap(const void *p) {
-  return p <= mem_heap_hi() && p >= mem_heap_lo();
+  clear n bytes at p, which is ALIGNMENT aligned. Big ranges are
+  cleared with non-temporal stores so they do not evict the caches
+*/
+static void zero_bytes(char*p, size_t n) {
+#ifdef __SSE2__
+  if (n >= NT_ZERO) {
+    __m128i z = _mm_setzero_si128();
+    char* end = p + (n & ~(size_t)63);
+    for (; p < end; p += 64) {
+      _mm_stream_si128((__m128i*)p, z);
+      _mm_stream_si128((__m128i*)(p+16), z);
+      _mm_stream_si128((__m128i*)(p+32), z);
+      _mm_stream_si128((__m128i*)(p+48), z);
+    }
+    _mm_sfence();
+    n &= 63;
+  }
+#endif
+  memset(p, 0, n);
 }
 
 /*
- * Return whether the pointer is aligned.
- * May be useful for debugging.
- */
-static int aligned(const void *p) {
-  return (size_t)ALIGN(p) == (size_t)p;
+  return size bytes aligned to align, a power of two. Slab objects are
+  only ALIGNMENT aligned, so over-aligned small requests get a block
+  cut out of a free block at the right offset instead
+*/
+void *memalign(size_t align, size_t size) {
+  size_t asize;
+  char* bp;
+  struct tcache* tc;
+  struct arena* a;
+  if (align <= ALIGNMENT)
+    return malloc(size);
+  if ((align & (align-1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (size == 0)
+    return NULL;
+  if (size >= mmap_threshold || align > MAX_HEAP_REQUEST - size) {
+    stat_add(&get_tcache()->stats.nmap, 1);
+    return mmap_alloc(size, align);
+  }
+  asize = block_size(size <= SLAB_MAXSIZE ? SLAB_MAXSIZE + 1 : size);
+  tc = get_tcache();
+  stat_add(&tc->stats.nmalloc[block_class(asize)], 1);
+  a = lock_arena(tc);
+  bp = alloc_aligned(a, asize, align);
+  pthread_mutex_unlock(&a->lock);
+  return bp;
 }
 
-/*
- * mm_checkheap
- */
+int posix_memalign(void **memptr, size_t align, size_t size) {
+  void* p;
+  if (align < sizeof(void*) || (align & (align-1)) != 0)
+    return EINVAL;
+  p = memalign(align, size);
+  if (p == NULL && size != 0)
+    return ENOMEM;
+  *memptr = p;
+  return 0;
+}
 
+void *aligned_alloc(size_t align, size_t size) {
+  return memalign(align, size);
+}
 
-/*check whether the bucket size works*/
-int checkBucketSize(char* c, int index) {
-  if (index == 0) {
-    if (GET_SIZE(c) > 32)
-      return 0;
-  }
-  else if (index == 1) {
-    if (GET_SIZE(c) > 64)
-      return 0;
+/*
+  allocate n objects of size bytes into ptrs and return how many could
+  be allocated. The thread cache is emptied first, the rest comes from
+  the arena under one lock: slab objects straight from the slabs, and
+  blocks cut out of one large block in a single pass
+*/
+size_t malloc_batch(size_t size, void **ptrs, size_t n) {
+  size_t i = 0, k, asize = 0;
+  struct tcache* tc;
+  struct arena* a;
+  char* bp;
+  int bin = -1;
+  if (size == 0 || n == 0)
+    return 0;  //nothing to count, bin may not be a cache bin
+  tc = get_tcache();
+  if (size >= mmap_threshold) {
+    while (i < n && (ptrs[i] = mmap_alloc(size, ALIGNMENT)) != NULL)
+      i++;
+    stat_add(&tc->stats.nmap, i);
+    return i;
   }
-  else if (index == 2) {
-    if (GET_SIZE(c) > 128)
-      return 0;
+  if (size <= SLAB_MAXSIZE)
+    bin = slab_class(size);
+  else if ((asize = block_size(size)) <= TC_MAXSIZE)
+    bin = block_bin(asize);
+  for (; bin >= 0 && i < n && tc->bins[bin] != NULL; i++) {
+    ptrs[i] = tc->bins[bin];
+    tc->bins[bin] = NEXT_OBJ(tc->bins[bin]);
+    tc->nin[bin]--;  //a batch is counted in the stats
+    tc->nfill[bin]--;
+    UNTAG(ptrs[i]);
   }
-  else if (index == 3) {
-     if (GET_SIZE(c) > 256)
-       return 0;
+  if (i == n) {
+    stat_add(&tc->stats.nmalloc[bin], n);
+    return n;
   }
-  else if (index == 4) {
-     if (GET_SIZE(c) > 512)
-       return 0;
+  a = lock_arena(tc);
+  drain_remote(a);
+  if (size <= SLAB_MAXSIZE) {
+    while (i < n && (ptrs[i] = slab_alloc(a,bin)) != NULL)
+      i++;
   }
-  else if (index == 5) {
-    if (GET_SIZE(c) > 1024)
-     return 0;
-  } 
-  else if (index == 6) {
-    if (GET_SIZE(c) > 2048)
-      return 0;
-   }
-  else if (index == 7) {
-    if (GET_SIZE(c) > 4096)
-      return 0;
+  while (size > SLAB_MAXSIZE && i < n) {
+    k = n - i;
+    if (k > BATCH_BYTES/asize)
+      k = BATCH_BYTES/asize > 0 ? BATCH_BYTES/asize : 1;
+    if ((bp = alloc_block(a,k*asize)) == NULL) {
+      k = 1;
+      if ((bp = alloc_block(a,asize)) == NULL)
+        break;
+    }
+    bp = bp - WSIZE;
+    split_run(bp,asize,k);
+    for (; k > 0; k--, i++, bp += asize)
+      ptrs[i] = bp + WSIZE;
   }
-  else {
-    if (GET_SIZE(c) <=4096)
-      return 0;
+  pthread_mutex_unlock(&a->lock);
+  stat_add(&tc->stats.nmalloc[bin >= 0 ? bin : block_class(asize)], i);
+  return i;
+}
+
+/*
+  free ptr, which was allocated with size bytes. Sizes served from the
+  thread cache pick their bin from size, so neither the header nor the
+  slab header is read. Anything else is a plain free
+*/
+void free_sized(void *ptr, size_t size) {
+  size_t asize = block_size(size);
+  if (ptr == NULL)
+    return;
+  if (trace_on)
+    trace_op('f', ptr, NULL, 0, 0);
+  if (MM_HARDEN || size == 0 || asize > TC_MAXSIZE || is_mapped(ptr) ||
+      __atomic_load_n(&prof_live, __ATOMIC_RELAXED) != 0) {
+    do_free(ptr);  //it may be sampled, do_free() looks at the header
+    return;
   }
-  return 1;
+  struct tcache* tc = get_tcache();
+  int bin = size <= SLAB_MAXSIZE ? slab_class(size) : block_bin(asize);
+  tcache_put(tc, bin, ptr);
 }
 
-void mm_checkheap(int verbose) {
-  
-  if (verbose == 1) //redirect standard output
-    dup2(2,1);
-  unsigned int index = 0;
-  char*prologue = (char*)(heap_listp+9);
-  char*begin = prologue +WSIZE;
-  if (GET_ALLOC(prologue) != 1)
-    printf("invalid prologue header\n");   //check prologue 
-  if (GET_SIZE(prologue) !=0)
-    printf("invalid prologue header\n");
-  
-  while (GET_ALLOC(begin)!=1 && GET_SIZE(prologue) !=0) {
-    if (GET_ALLOC(begin) != 1)  {
-      char* ptr = *(heap_listp+getIndex(GET_SIZE(begin))); 
-      while (ptr != NULL) { 
-	if (ptr == begin)   //search for the block in the bucket
-	  break;
-	else
-	  ptr = NEXT_FREE(ptr);
+/*
+  free ptr, which came from memalign with align and size. Over-aligned
+  requests are always blocks, see memalign
+*/
+void free_aligned_sized(void *ptr, size_t align, size_t size) {
+  size_t asize;
+  if (align <= ALIGNMENT) {
+    free_sized(ptr, size);
+    return;
+  }
+  asize = block_size(size <= SLAB_MAXSIZE ? SLAB_MAXSIZE + 1 : size);
+  if (trace_on && ptr != NULL)
+    trace_op('f', ptr, NULL, 0, 0);
+  if (MM_HARDEN || ptr == NULL || asize > TC_MAXSIZE || is_mapped(ptr) ||
+      __atomic_load_n(&prof_live, __ATOMIC_RELAXED) != 0) {
+    do_free(ptr);
+    return;
+  }
+  struct tcache* tc = get_tcache();
+  tcache_put(tc, block_bin(asize), ptr);
+}
+
+/*
+  return how many bytes can be used at ptr, including the slack of a
+  block place() did not split
+*/
+size_t malloc_usable_size(void *ptr) {
+  return ptr == NULL ? 0 : usable_size(ptr);
+}
+
+static int cmp_ptr(const void* x, const void* y) {
+  const char* p = *(char* const*)x;
+  const char* q = *(char* const*)y;
+  return p < q ? -1 : p > q;
+}
+
+/*
+  free the blocks from bp up to end, adjacent blocks of arena a, as one
+  block so they are coalesced once. Caller holds the arena lock
+*/
+static void free_run(struct arena* a, char*bp, char*end) {
+  PUT((unsigned int *)bp,PACK(end - bp,1) | (GET(bp) & PREV_ALLOC));
+  check_merged(a, bp, end);
+  free_block(a,bp);
+}
+
+/*
+  free the n objects in ptrs, which gets sorted by address. The objects
+  of one arena are freed under one lock, bypassing the thread cache, and
+  runs of adjacent blocks are merged before they are coalesced
+*/
+void free_batch(void **ptrs, size_t n) {
+  struct tcache* tc = get_tcache();
+  struct arena* a = NULL;
+  char* run = NULL;  //header of the run of adjacent blocks
+  char* end = NULL;  //just past the run
+  size_t i;
+  qsort(ptrs, n, sizeof(void*), cmp_ptr);
+  for (i = 0; MM_HARDEN && i < n; i++) {  //before any lock is taken
+    if (ptrs[i] == NULL)
+      continue;
+    if (i > 0 && ptrs[i] == ptrs[i-1])
+      harden_fail("double free", ptrs[i]);
+    check_ptr(tc, ptrs[i]);
+    if (poison)
+      poison_payload(ptrs[i]);
+  }
+  for (i = 0; i < n; i++) {
+    char* p = ptrs[i];
+    if (p == NULL)
+      continue;
+    if (is_mapped(p)) {
+      if (__atomic_load_n(&prof_live, __ATOMIC_RELAXED) != 0)
+        prof_drop(p);
+      stat_add(&tc->stats.nunmap, 1);
+      stat_size(&mapped_size, &mapped_peak, -(long)*(size_t*)(p - MAP_HDR));
+      munmap(map_start(p), *(size_t*)(p - MAP_HDR));
+      continue;
+    }
+    if (arena_of(p) != a) {
+      if (run != NULL)
+        free_run(a,run,end);
+      run = NULL;
+      if (a != NULL)
+        pthread_mutex_unlock(&a->lock);
+      a = arena_of(p);
+      pthread_mutex_lock(&a->lock);
+      drain_remote(a);
+    }
+    if (!is_slab(p) && (GET(p - WSIZE) & SAMPLED))
+      prof_drop(p);  //free_run rewrites the header
+    stat_add(&tc->stats.nfree[is_slab(p) ? slab_of(p)->cls : block_class(GET_SIZE(p - WSIZE))], 1);
+    if (is_slab(p))
+      slab_free(a,p);
+    else if (run != NULL && p - WSIZE == end)
+      end += GET_SIZE(p - WSIZE);  //right after the run, merge
+    else {
+      if (run != NULL)
+        free_run(a,run,end);
+      run = p - WSIZE;
+      end = run + GET_SIZE(run);
+    }
+  }
+  if (run != NULL)
+    free_run(a,run,end);
+  if (a != NULL)
+    pthread_mutex_unlock(&a->lock);
+}
+
+/*
+  make a pool of objects of obj_size bytes aligned to align, a power of
+  two, or to ALIGNMENT if align is 0. Return NULL if align is not a power
+  of two or memory runs out
+*/
+struct mm_pool* mm_pool_create(size_t obj_size, size_t align) {
+  struct mm_pool* pl;
+  if (align == 0)
+    align = ALIGNMENT;
+  if ((align & (align-1)) != 0 || align > PAGE_SIZE) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (align < sizeof(char*))
+    align = sizeof(char*);  //room for the link, aligned
+  if (obj_size == 0 || obj_size > POOL_CHUNK_MAX / POOL_MIN_OBJS) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if ((pl = do_malloc(sizeof(struct mm_pool))) == NULL)
+    return NULL;
+  pl->size = (obj_size + align-1) & ~(align-1);
+  pl->align = align;
+  pl->free = pl->bump = pl->end = pl->chunks = NULL;
+  pl->chunk = POOL_CHUNK;
+  return pl;
+}
+
+/*
+  return a chunk of at least size bytes aligned to align for a pool or
+  a region: a block of one of the thread's arenas, straight from the
+  seg lists or extend_heap, or a mapping if it is that large. NULL if
+  memory runs out
+*/
+static char* take_chunk(size_t size, size_t align) {
+  struct tcache* tc = get_tcache();
+  struct arena* a;
+  unsigned int asize;
+  char* p;
+  if (size >= mmap_threshold || size > MAX_HEAP_REQUEST - align) {
+    stat_add(&tc->stats.nmap, 1);
+    return mmap_alloc(size, align);
+  }
+  asize = block_size(size);
+  a = lock_arena(tc);
+  p = align > ALIGNMENT ? alloc_aligned(a, asize, align) : alloc_block(a, asize);
+  pthread_mutex_unlock(&a->lock);
+  if (p != NULL)
+    stat_add(&tc->stats.nmalloc[block_class(asize)], 1);
+  return p;
+}
+
+/*
+  take the next chunk for the pool and start bumping through it. Return
+  -1 if memory runs out
+*/
+static int pool_grow(struct mm_pool* pl) {
+  size_t want = pl->chunk;
+  char* p;
+  if (want < sizeof(char*) + pl->align + POOL_MIN_OBJS*pl->size)
+    want = sizeof(char*) + pl->align + POOL_MIN_OBJS*pl->size;
+  if ((p = take_chunk(want, pl->align)) == NULL)
+    return -1;
+  *(char**)p = pl->chunks;
+  pl->chunks = p;
+  pl->bump = p + ((sizeof(char*) + pl->align-1) & ~(pl->align-1));
+  pl->end = p + usable_size(p);
+  if (pl->chunk < POOL_CHUNK_MAX)
+    pl->chunk *= 2;
+  return 0;
+}
+
+/*
+  return an object of the pool, or NULL if memory runs out
+*/
+void* mm_pool_alloc(struct mm_pool* pl) {
+  char* p = pl->free;
+  if (p != NULL) {
+    pl->free = (char*)(*(size_t*)p ^ link_mask(p));
+    if (MM_HARDEN && ((size_t)pl->free & (pl->align-1)) != 0)
+      harden_fail("corrupted pool link", p);
+    return p;
+  }
+  if ((size_t)(pl->end - pl->bump) < pl->size && pool_grow(pl) < 0)
+    return NULL;
+  p = pl->bump;
+  pl->bump += pl->size;
+  return p;
+}
+
+/*
+  give the object p back to the pool it came from
+*/
+void mm_pool_free(struct mm_pool* pl, void* p) {
+  if (p == NULL)
+    return;
+  *(size_t*)p = (size_t)pl->free ^ link_mask(p);
+  pl->free = p;
+}
+
+/*
+  free the pool and every object in it
+*/
+void mm_pool_destroy(struct mm_pool* pl) {
+  char* p;
+  if (pl == NULL)
+    return;
+  while ((p = pl->chunks) != NULL) {
+    pl->chunks = *(char**)p;
+    do_free(p);
+  }
+  do_free(pl);
+}
+
+/*
+  ask for the pages from p on to be placed on the NUMA node. The node is
+  preferred, not enforced, so a full node does not fail the allocation
+*/
+static void bind_node(char*p, size_t len, int node) {
+  unsigned long mask[NUMA_NODES / (8*sizeof(long))] = { 0 };
+  if (node >= NUMA_NODES)
+    return;
+  mask[node / (8*sizeof(long))] = 1UL << (node % (8*sizeof(long)));
+  syscall(SYS_mbind, p, len, MPOL_PREFERRED, mask, NUMA_NODES + 1, 0);
+}
+
+/*
+  make an empty bump region. Return NULL if memory runs out
+*/
+struct mm_region* mm_region_create(void) {
+  struct mm_region* r = do_malloc(sizeof(struct mm_region));
+  if (r == NULL)
+    return NULL;
+  r->bump = r->end = r->chunks = NULL;
+  r->chunk = SCRATCH_CHUNK;
+  return r;
+}
+
+/*
+  the current chunk of the region is too small for size bytes. Give a
+  large request a chunk of its own, behind the current one, and start a
+  new current chunk for anything else. Return NULL if memory runs out
+*/
+static void* region_grow(struct mm_region* r, size_t size) {
+  char* p;
+  if (size > r->chunk/4) {
+    if ((p = take_chunk(SCRATCH_HDR + size, ALIGNMENT)) == NULL)
+      return NULL;
+    if (r->chunks == NULL) {  //still the current one, but full
+      *(char**)p = NULL;
+      r->chunks = p;
+      r->bump = r->end = p;
+    }
+    else {
+      *(char**)p = *(char**)r->chunks;
+      *(char**)r->chunks = p;
+    }
+    return p + SCRATCH_HDR;
+  }
+  if ((p = take_chunk(r->chunk, ALIGNMENT)) == NULL)
+    return NULL;
+  *(char**)p = r->chunks;
+  r->chunks = p;
+  r->bump = p + SCRATCH_HDR + size;
+  r->end = p + usable_size(p);
+  if (r->chunk < SCRATCH_CHUNK_MAX)
+    r->chunk *= 2;
+  return p + SCRATCH_HDR;
+}
+
+/*
+  return size bytes of the region, ALIGNMENT aligned, or NULL if memory
+  runs out. They stay until the region is reset or destroyed
+*/
+void* mm_region_alloc(struct mm_region* r, size_t size) {
+  char* p = r->bump;
+  if (size == 0 || size > MAX_HEAP_REQUEST)
+    return NULL;
+  size = ALIGN(size);
+  if ((size_t)(r->end - p) < size)
+    return region_grow(r, size);
+  r->bump = p + size;
+  return p;
+}
+
+/*
+  free everything allocated from the region. The current chunk is kept
+  and bumped through again, the others are freed
+*/
+void mm_region_reset(struct mm_region* r) {
+  char* p;
+  if (r->chunks == NULL)
+    return;
+  while ((p = *(char**)r->chunks) != NULL) {
+    *(char**)r->chunks = *(char**)p;
+    do_free(p);
+  }
+  if (r->end == r->chunks) {  //a chunk of a large request, not worth keeping
+    do_free(r->chunks);
+    r->bump = r->end = r->chunks = NULL;
+    return;
+  }
+  r->bump = r->chunks + SCRATCH_HDR;
+}
+
+/*
+  free the region and everything allocated from it
+*/
+void mm_region_destroy(struct mm_region* r) {
+  char* p;
+  if (r == NULL)
+    return;
+  while ((p = r->chunks) != NULL) {
+    r->chunks = *(char**)p;
+    do_free(p);
+  }
+  do_free(r);
+}
+
+/*
+  move the byte count size by delta and raise peak to match
+*/
+static void stat_size(size_t* size, size_t* peak, long delta) {
+  size_t now, old;
+  if (!MM_STATS)
+    return;
+  now = __atomic_add_fetch(size, delta, __ATOMIC_RELAXED);
+  old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+  while (now > old && !__atomic_compare_exchange_n(peak, &old, now, 1,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/* add up n counters that somebody else may be writing */
+static void add_counters(unsigned long* sum, unsigned long* c, unsigned int n) {
+  unsigned int i;
+  for (i = 0; i < n; i++)
+    sum[i] += __atomic_load_n(&c[i], __ATOMIC_RELAXED);
+}
+
+/*
+  add up the counters of every thread and every arena. The threads stay
+  on the list while stats_lock is held, their counts may still move
+*/
+static void collect_stats(struct thread_stats* ts, struct arena_stats* as) {
+  struct tcache* tc;
+  int i;
+  memset(ts, 0, sizeof(*ts));
+  memset(as, 0, sizeof(*as));
+  pthread_mutex_lock(&stats_lock);
+  add_counters((unsigned long*)ts, (unsigned long*)&retired, sizeof(*ts)/sizeof(long));
+  for (tc = threads; tc != NULL; tc = tc->next) {
+    if (__atomic_load_n(&tc->gen, __ATOMIC_RELAXED) != heap_gen)
+      continue;
+    add_counters((unsigned long*)ts, (unsigned long*)&tc->stats, sizeof(*ts)/sizeof(long));
+    for (i = 0; i < TC_BINS && MM_STATS; i++) {
+      ts->nmalloc[i] += __atomic_load_n(&tc->nmalloc[i], __ATOMIC_RELAXED);
+      ts->nfree[i] += __atomic_load_n(&tc->nin[i], __ATOMIC_RELAXED) -
+                      __atomic_load_n(&tc->nfill[i], __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&stats_lock);
+  for (i = 0; i < narenas; i++)
+    add_counters((unsigned long*)as, (unsigned long*)&arenas[i].stats, sizeof(*as)/sizeof(long));
+}
+
+/* everything the stats readers see, the counters added up */
+struct stats {
+  struct thread_stats t;
+  struct arena_stats a;
+  unsigned long class_size[STAT_CLASSES];  //largest request of the class
+  unsigned long heap_size, heap_peak, mapped_size, mapped_peak;
+};
+
+/*
+  statistics: name for mm_getstat, offset in struct stats and number of
+  counters. Arrays are read one counter at a time as name.i, or summed
+  up under the plain name
+*/
+static const struct stat_name {
+  const char* name;
+  size_t offset;
+  unsigned int n;
+} stat_names[] = {
+  { "nmalloc", offsetof(struct stats, t.nmalloc), STAT_CLASSES },
+  { "nfree", offsetof(struct stats, t.nfree), STAT_CLASSES },
+  { "class_size", offsetof(struct stats, class_size), STAT_CLASSES },
+  { "nmalloc_mapped", offsetof(struct stats, t.nmap), 1 },
+  { "nfree_mapped", offsetof(struct stats, t.nunmap), 1 },
+  { "fit_hit", offsetof(struct stats, a.fit_hit), 1 },
+  { "fit_miss", offsetof(struct stats, a.fit_miss), 1 },
+  { "fit_scan", offsetof(struct stats, a.fit_scan), STAT_SCANS },
+  { "extend_calls", offsetof(struct stats, a.nextend), 1 },
+  { "extend_bytes", offsetof(struct stats, a.extend_bytes), 1 },
+  { "coalesce", offsetof(struct stats, a.ncoalesce), 4 },
+  { "heap_size", offsetof(struct stats, heap_size), 1 },
+  { "heap_peak", offsetof(struct stats, heap_peak), 1 },
+  { "mapped_size", offsetof(struct stats, mapped_size), 1 },
+  { "mapped_peak", offsetof(struct stats, mapped_peak), 1 },
+};
+
+static void read_stats(struct stats* st) {
+  int i;
+  collect_stats(&st->t, &st->a);
+  st->a.fit_scan[0] = st->a.fit_hit + st->a.fit_miss;
+  for (i = 1; i < STAT_SCANS; i++)
+    st->a.fit_scan[0] -= st->a.fit_scan[i];
+  for (i = 0; i < STAT_CLASSES; i++) {
+    if (i < NSLAB)
+      st->class_size[i] = slab_size(i);
+    else if (i < TC_BINS)
+      st->class_size[i] = SLAB_MAXSIZE + (i - NSLAB + 1)*ALIGNMENT - WSIZE;
+    else  //the last block of row i - TC_BINS
+      st->class_size[i] = (1UL << (i - TC_BINS + FL_SHIFT)) - ALIGNMENT - WSIZE;
+  }
+  st->heap_size = __atomic_load_n(&heap_size, __ATOMIC_RELAXED);
+  st->heap_peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+  st->mapped_size = __atomic_load_n(&mapped_size, __ATOMIC_RELAXED);
+  st->mapped_peak = __atomic_load_n(&mapped_peak, __ATOMIC_RELAXED);
+}
+
+/*
+  read the statistic called name into value, name.i for counter i of an
+  array. Return -1 if there is no such statistic
+*/
+int mm_getstat(const char* name, size_t* value) {
+  struct stats st;
+  unsigned int i, k;
+  for (i = 0; i < sizeof(stat_names)/sizeof(stat_names[0]); i++) {
+    const struct stat_name* s = &stat_names[i];
+    size_t len = strlen(s->name);
+    unsigned long* c = (unsigned long*)((char*)&st + s->offset);
+    char* end;
+    if (strncmp(s->name, name, len) != 0 || (name[len] != '\0' && name[len] != '.'))
+      continue;
+    read_stats(&st);
+    *value = 0;
+    if (name[len] == '\0') {
+      for (k = 0; k < s->n; k++)
+        *value += c[k];
+      return 0;
+    }
+    k = strtoul(name + len + 1, &end, 10);
+    if (end == name + len + 1 || *end != '\0' || k >= s->n)
+      return -1;
+    *value = c[k];
+    return 0;
+  }
+  return -1;
+}
+
+/*
+  write every statistic to out as a "name value" line. Of the per class
+  arrays only the classes that were ever allocated or freed are written
+*/
+void mm_stats_print(FILE* out) {
+  struct stats st;
+  unsigned int i, k;
+  read_stats(&st);
+  for (i = 0; i < sizeof(stat_names)/sizeof(stat_names[0]); i++) {
+    const struct stat_name* s = &stat_names[i];
+    unsigned long* c = (unsigned long*)((char*)&st + s->offset);
+    if (s->n == 1) {
+      fprintf(out, "%s %lu\n", s->name, c[0]);
+      continue;
+    }
+    for (k = 0; k < s->n; k++)
+      if (s->n != STAT_CLASSES || st.t.nmalloc[k] != 0 || st.t.nfree[k] != 0)
+        fprintf(out, "%s.%u %lu\n", s->name, k, c[k]);
+  }
+}
+
+/*
+  return the bytes to allocate before the next sample: exponentially
+  distributed with mean prof_sample, so every byte is equally likely
+  to be sampled. -ln(u) comes from a log2 that is linear between
+  powers of two, in 16.16 fixed point
+*/
+static long prof_interval(struct tcache* tc) {
+  unsigned long r, lg;
+  int e;
+  if (tc->prof_rng == 0)
+    tc->prof_rng = (size_t)tc ^ (size_t)time(NULL);
+  tc->prof_rng = tc->prof_rng*6364136223846793005UL + 1442695040888963407UL;
+  r = (tc->prof_rng >> 38) + 1;  //uniform in [1, 2^26]
+  e = 8*sizeof(long) - 1 - __builtin_clzl(r);
+  lg = ((unsigned long)e << 16) + (((r - (1UL << e)) << 16) >> e);
+  lg = (((26UL << 16) - lg) * 45426) >> 16;  //times ln 2
+  return (long)((lg * prof_sample) >> 16) + 1;
+}
+
+/* hash bucket of the payload pointer p */
+static inline struct prof_rec** prof_bucket(const char*p) {
+  return &prof_table[(((size_t)p >> ALIGN_LOG2) * 0x9e3779b97f4a7c15UL) >> (8*sizeof(long) - PROF_LOG2)];
+}
+
+/*
+  the countdown of tc ran out. Start the next one and, if profiling is
+  on, allocate size bytes as a sampled block or mapping and record the
+  backtrace of the caller. Return NULL to let the caller allocate as usual.
+  Never inlined, so the caller is always the second frame of the trace
+*/
+static __attribute__((noinline)) void* prof_alloc(struct tcache* tc, size_t size) {
+  void* pc[PROF_DEPTH + 2];
+  struct prof_rec* r;
+  struct arena* a;
+  unsigned int asize, i;
+  char* p = NULL;
+  int depth;
+  if (prof_sample == 0) {
+    tc->prof_left = PROF_RECHECK;
+    return NULL;
+  }
+  tc->prof_left = PROF_RECHECK;  //backtrace may malloc, don't sample that
+  depth = backtrace(pc, PROF_DEPTH + 2) - 2;
+  pthread_mutex_lock(&prof_lock);
+  if (prof_spare == NULL) {  //records come from mmap so they never sample
+    r = mmap(NULL, 16*PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    for (i = 0; r != MAP_FAILED && i < 16*PAGE_SIZE/sizeof(*r); i++) {
+      r[i].next = prof_spare;
+      prof_spare = &r[i];
+    }
+  }
+  if ((r = prof_spare) != NULL)
+    prof_spare = r->next;
+  pthread_mutex_unlock(&prof_lock);
+  tc->prof_left = prof_interval(tc);
+  if (r == NULL)
+    return NULL;
+  if (size >= mmap_threshold) {
+    if ((p = mmap_alloc(size, ALIGNMENT)) != NULL)
+      stat_add(&tc->stats.nmap, 1);
+  }
+  else if (size <= MAX_HEAP_REQUEST) {  //small sizes get a block too, to hold the flag
+    asize = block_size(size <= SLAB_MAXSIZE ? SLAB_MAXSIZE + 1 : size);
+    a = lock_arena(tc);
+    if ((p = alloc_block(a,asize)) != NULL) {
+      PUT((unsigned int *)(p-WSIZE),GET(p-WSIZE) | SAMPLED);
+      stat_add(&tc->stats.nmalloc[block_class(asize)], 1);
+    }
+    pthread_mutex_unlock(&a->lock);
+  }
+  r->p = p;
+  r->size = size;
+  r->depth = depth < 0 ? 0 : depth;
+  memcpy(r->pc, pc + 2, r->depth*sizeof(void*));
+  pthread_mutex_lock(&prof_lock);
+  if (p == NULL) {
+    r->next = prof_spare;
+    prof_spare = r;
+  }
+  else {
+    r->next = *prof_bucket(p);
+    *prof_bucket(p) = r;
+    prof_live++;
+  }
+  pthread_mutex_unlock(&prof_lock);
+  return p;
+}
+
+/* return whether the payload p has a sample */
+static int prof_sampled(char*p) {
+  struct prof_rec* r;
+  pthread_mutex_lock(&prof_lock);
+  for (r = *prof_bucket(p); r != NULL && r->p != p; r = r->next)
+    ;
+  pthread_mutex_unlock(&prof_lock);
+  return r != NULL;
+}
+
+/*
+  forget the sample of the payload p. Return whether there was one
+*/
+static int prof_drop(char*p) {
+  struct prof_rec** rp;
+  struct prof_rec* r;
+  pthread_mutex_lock(&prof_lock);
+  for (rp = prof_bucket(p); *rp != NULL && (*rp)->p != p; rp = &(*rp)->next)
+    ;
+  if ((r = *rp) != NULL) {
+    *rp = r->next;
+    r->next = prof_spare;
+    prof_spare = r;
+    prof_live--;
+  }
+  pthread_mutex_unlock(&prof_lock);
+  return r != NULL;
+}
+
+/* forget every sample, mm_init has thrown their heap away */
+static void prof_reset(void) {
+  int i;
+  pthread_mutex_lock(&prof_lock);
+  for (i = 0; i < PROF_BUCKETS; i++) {
+    while (prof_table[i] != NULL) {
+      struct prof_rec* r = prof_table[i];
+      prof_table[i] = r->next;
+      r->next = prof_spare;
+      prof_spare = r;
+    }
+  }
+  prof_live = 0;
+  pthread_mutex_unlock(&prof_lock);
+}
+
+/* write all n bytes of buf to fd */
+static int write_all(int fd, const char* buf, size_t n) {
+  while (n > 0) {
+    ssize_t k = write(fd, buf, n);
+    if (k < 0 && errno != EINTR)
+      return -1;
+    if (k > 0) {
+      buf += k;
+      n -= k;
+    }
+  }
+  return 0;
+}
+
+/*
+  write the live samples to path as a pprof heap profile (the heap_v2
+  text format pprof scales back up by the sampling rate), followed by
+  the mappings so pprof can symbolize the addresses. Nothing here calls
+  malloc. Return -1 on error
+*/
+int mm_prof_dump(const char* path) {
+  char buf[64 + 20*PROF_DEPTH];
+  size_t count = 0, bytes = 0;
+  struct prof_rec* r;
+  int fd, i, n, d, err;
+  if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+    return -1;
+  pthread_mutex_lock(&prof_lock);
+  for (i = 0; i < PROF_BUCKETS; i++)
+    for (r = prof_table[i]; r != NULL; r = r->next) {
+      count++;
+      bytes += r->size;
+    }
+  n = snprintf(buf, sizeof(buf), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+               count, bytes, count, bytes, prof_sample);
+  err = write_all(fd, buf, n);
+  for (i = 0; i < PROF_BUCKETS && err == 0; i++)
+    for (r = prof_table[i]; r != NULL && err == 0; r = r->next) {
+      n = snprintf(buf, sizeof(buf), "1: %zu [1: %zu] @", r->size, r->size);
+      for (d = 0; d < r->depth; d++)
+        n += snprintf(buf + n, sizeof(buf) - n, " %p", r->pc[d]);
+      buf[n++] = '\n';
+      err = write_all(fd, buf, n);
+    }
+  pthread_mutex_unlock(&prof_lock);
+  if (err == 0)
+    err = write_all(fd, "\nMAPPED_LIBRARIES:\n", 19);
+  if (err == 0) {
+    int maps = open("/proc/self/maps", O_RDONLY);
+    ssize_t k;
+    while (maps >= 0 && err == 0 && (k = read(maps, buf, sizeof(buf))) > 0)
+      err = write_all(fd, buf, k);
+    if (maps >= 0)
+      close(maps);
+  }
+  if (close(fd) < 0)
+    err = -1;
+  return err;
+}
+
+/* timestamp of a trace record, cheap and ordered across cpus */
+static inline unsigned long trace_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000UL + ts.tv_nsec;
+#endif
+}
+
+/*
+  append an op to the calling thread's ring, mapping the ring on the
+  thread's first op, stamped when or now if when is 0. When the ring is
+  full the thread waits for the flusher. A thread that has already
+  exited its cache is not traced anymore
+*/
+static void trace_op(int op, void* p, void* old, size_t size, unsigned long when) {
+  struct tcache* tc = get_tcache();
+  struct trace_ring* r = tc->ring;
+  struct trace_rec* e;
+  if (r == NULL) {
+    if (tc->pprev == NULL)
+      return;
+    r = mmap(NULL, sizeof(*r), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (r == MAP_FAILED)
+      return;
+    r->thread = syscall(SYS_gettid);
+    __atomic_store_n(&tc->ring, r, __ATOMIC_RELEASE);
+  }
+  while (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= TRACE_RING)
+    sched_yield();
+  e = &r->rec[r->head % TRACE_RING];
+  e->time = when != 0 ? when : trace_clock();
+  e->ptr = (size_t)p;
+  e->old = (size_t)old;
+  e->size = size;
+  e->thread = r->thread;
+  e->op = op;
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+  write out what is in the ring. If the file cannot take it tracing
+  stops, and the ring is emptied anyway so nobody waits on it. Caller
+  holds trace_lock
+*/
+static void trace_drain(struct trace_ring* r) {
+  unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  unsigned long tail = r->tail;
+  while (tail != head) {
+    unsigned long i = tail % TRACE_RING;
+    unsigned long n = head - tail < TRACE_RING - i ? head - tail : TRACE_RING - i;
+    if (trace_on && write_all(trace_fd, (char*)&r->rec[i], n*sizeof(struct trace_rec)) < 0)
+      trace_on = 0;
+    tail += n;
+  }
+  __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+}
+
+/* write out the rings of all live threads */
+static void trace_flush(void) {
+  struct tcache* tc;
+  pthread_mutex_lock(&trace_lock);
+  pthread_mutex_lock(&stats_lock);
+  for (tc = threads; tc != NULL; tc = tc->next) {
+    struct trace_ring* r = __atomic_load_n(&tc->ring, __ATOMIC_ACQUIRE);
+    if (r != NULL)
+      trace_drain(r);
+  }
+  pthread_mutex_unlock(&stats_lock);
+  pthread_mutex_unlock(&trace_lock);
+}
+
+/* the flusher thread */
+static void* trace_main(void* arg) {
+  struct timespec ts = { 0, TRACE_PERIOD };
+  (void)arg;
+  for (;;) {
+    nanosleep(&ts, NULL);
+    trace_flush();
+  }
+  return NULL;
+}
+
+/*
+  open the file MM_TRACE names and start the flusher, once. What is left
+  in the rings at exit is flushed by atexit
+*/
+static void trace_start(void) {
+  const char* path = getenv("MM_TRACE");
+  pthread_t t;
+  if (trace_fd >= 0 || path == NULL || *path == '\0')
+    return;
+  if ((trace_fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+    return;
+  if (write_all(trace_fd, TRACE_MAGIC, 8) < 0 ||
+      pthread_create(&t, NULL, trace_main, NULL) != 0) {
+    close(trace_fd);
+    trace_fd = -1;
+    return;
+  }
+  pthread_detach(t);
+  atexit(trace_flush);
+  trace_on = 1;
+}
+
+
+/*
+  MM_HARDEN: pick the secret the links are encoded with and the tag of
+  freed objects. Every link is stored again before it is read, so a new
+  secret for every heap is fine
+*/
+static void harden_init(void) {
+  unsigned long seed = 0;
+  int i;
+  if (!MM_HARDEN)
+    return;
+  if (syscall(SYS_getrandom, &seed, sizeof(seed), 0) != sizeof(seed))
+    seed = (size_t)&seed ^ (size_t)time(NULL) * 0x9e3779b97f4a7c15UL;
+  link_secret = seed;
+  free_tag = (seed * 0x9e3779b97f4a7c15UL) | 1;  //never 0, so untagged objects differ
+  for (i = 0; i < NSLAB; i++)
+    slab_recip[i] = ((1UL << 32) + slab_size(i) - 1) / slab_size(i);
+}
+
+/*
+  report what went wrong at p and abort. The message is put together on
+  the stack, the heap can't be trusted any more
+*/
+static void harden_fail(const char* what, const void* p) {
+  char buf[128];
+  int n = snprintf(buf, sizeof(buf), "mm: %s at %p\n", what, p);
+  if (n > 0)
+    write_all(2, buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf) - 1);
+  abort();
+}
+
+/*
+  abort unless the payload pointer p is allocated: a block marked
+  allocated that its right neighbour agrees with, a slab object on an
+  object boundary, or a mapping with a sane length. A tagged object may
+  sit in a cache or a free list already, is_freed has the last word
+*/
+static __attribute__((noinline)) void check_ptr(struct tcache* tc, char*p) {
+  char* bp = p - WSIZE;
+  if ((size_t)p % ALIGNMENT != 0)
+    harden_fail("free of an unaligned pointer", p);
+  if (is_mapped(p)) {
+    size_t len = *(size_t*)(p - MAP_HDR);
+    if (len % PAGE_SIZE != 0 || len <= (size_t)(p - map_start(p)))
+      harden_fail("free of a bad pointer", p);
+    return;
+  }
+  if (page_owner[page_index(p)] == 0)
+    harden_fail("free of a pointer outside the arenas", p);
+  if (is_slab(p)) {
+    struct slab* s = slab_of(p);
+    unsigned int off = p - (char*)s - SLAB_HDR;
+    /* off is a multiple of the object size when off times its rounded up
+       reciprocal wraps to less than the reciprocal: exact below a page */
+    if (s->cls >= NSLAB || p < (char*)s + SLAB_HDR || p >= s->bump ||
+        off * slab_recip[s->cls] >= slab_recip[s->cls])
+      harden_fail("free of a bad pointer", p);
+  }
+  else {
+    unsigned int size = GET_SIZE(bp);
+    int sane = size >= MINSIZE && size <= (size_t)(heap_end - bp);
+    if (GET_ALLOC(bp) == 0)  //a free block has a footer to match
+      harden_fail(sane && GET(FOOTER(bp)) == PACK(size,0) ? "double free" : "free of a bad pointer", p);
+    if (!sane || !GET_PREV_ALLOC(bp + size))
+      harden_fail("free of a bad pointer or an overwritten header", p);
+    if (size < 2*MINSIZE)
+      return;  //too small to be tagged
+  }
+  if (((unsigned long*)p)[1] == free_tag && is_freed(tc, p))
+    harden_fail("double free", p);
+}
+
+/*
+  check the pointer p a free was handed. The tag, which catches a second
+  free of a cached object, is looked at every time, the rest of check_ptr
+  once in check_every frees
+*/
+static inline __attribute__((always_inline)) void harden_free(struct tcache* tc, char*p) {
+  if (--tc->unchecked < 0) {
+    tc->unchecked = check_every - 1;
+    check_ptr(tc, p);
+  }
+  else if (((unsigned long*)p)[1] == free_tag && is_freed(tc, p))
+    harden_fail("double free", p);
+}
+
+/*
+  whether the tagged object p is in the thread's cache, on its slab's
+  free list or on a quick list, where objects wait that are still marked
+  allocated. Other threads' caches are not looked at
+*/
+static int is_freed(struct tcache* tc, char*p) {
+  struct arena* a = arena_of(p);
+  unsigned int size = is_slab(p) ? 0 : GET_SIZE(p - WSIZE);
+  int bin = size == 0 ? slab_of(p)->cls : (size <= TC_MAXSIZE ? block_bin(size) : -1);
+  unsigned int i;
+  char* q;
+  int found = 0;
+  if (bin >= 0)
+    for (q = tc->bins[bin], i = 0; q != NULL && i <= bin_count(tc, bin); q = NEXT_OBJ(q), i++)
+      if (q == p)
+        return 1;
+  pthread_mutex_lock(&a->lock);
+  drain_remote(a);  //queued objects move to the slabs and quick lists
+  if (size == 0) {
+    struct slab* s = slab_of(p);
+    for (q = s->free, i = 0; q != NULL && i < s->nobj && !found; q = NEXT_OBJ(q), i++)
+      found = q == p;
+  }
+  else if (size <= QL_MAXSIZE) {
+    for (q = a->quick[size/ALIGNMENT], i = 0; q != NULL && i <= a->nquick && !found; q = NEXT_OBJ(q), i++)
+      found = q == p;
+  }
+  pthread_mutex_unlock(&a->lock);
+  return found || (size != 0 && GET_ALLOC(p - WSIZE) == 0);
+}
+
+/*
+  fill the payload p, about to be freed, with POISON_BYTE, sparing the
+  links and tag at the front and the footer word at the end
+*/
+static void poison_payload(char*p) {
+  size_t n;
+  if (is_mapped(p))
+    return;
+  n = usable_size(p);
+  if (n > 2*sizeof(char*) + WSIZE)
+    memset(p + 2*sizeof(char*), POISON_BYTE, n - 2*sizeof(char*) - WSIZE);
+}
+
+
+/*
+ * Return whether the pointer is in the heap.
+ * May be useful for debugging.
+ */
+static int in_heap(const void *p) {
+  return p <= mem_heap_hi() && p >= mem_heap_lo();
+}
+
+/*
+ * Return whether the pointer is aligned.
+ * May be useful for debugging.
+ */
+static int aligned(const void *p) {
+  return (size_t)ALIGN(p) == (size_t)p;
+}
+
+/*
+ * mm_checkheap
+ */
+
+
+/*check whether the bucket size works*/
+int checkBucketSize(char* c, int index) {
+  return getIndex(GET_SIZE(c)) == index;
+}
+
+static const char* check_errors[CHECK_ERRORS] = {
+  "ok",
+  "invalid prologue",
+  "invalid epilogue",
+  "bad block size",
+  "payload not aligned",
+  "block of another arena",
+  "wrong prev alloc bit",
+  "footer does not match header",
+  "free neighbours not coalesced",
+  "free block not in its seg list",
+  "bitmap does not match the seg lists",
+  "wrong block on a quick list",
+  "bad slab",
+};
+
+/*
+  check the free block bp, and that it is in the seg list of its size:
+  it is the head of the list, or its neighbours on the list are free
+  blocks of the same list that link back to it. No list is walked
+*/
+static int check_free(struct arena* a, char*bp) {
+  int index = getIndex(GET_SIZE(bp));
+  char* prev = PREV_FREE(bp);
+  char* next = NEXT_FREE(bp);
+  if (GET(FOOTER(bp)) != PACK(GET_SIZE(bp),0))
+    return CHECK_FOOTER;
+  if (GET_PREV_ALLOC(bp) == 0 || GET_ALLOC(bp + GET_SIZE(bp)) == 0)
+    return CHECK_COALESCE;
+  if (GET_PREV_ALLOC(bp + GET_SIZE(bp)) != 0)
+    return CHECK_PREV_ALLOC;
+  if (prev == NULL ? a->buckets[index] != bp :
+      (!in_heap(prev) || !aligned(prev + WSIZE) || GET_ALLOC(prev) ||
+       NEXT_FREE(prev) != bp || !checkBucketSize(prev,index)))
+    return CHECK_LIST;
+  if (next != NULL &&
+      (!in_heap(next) || !aligned(next + WSIZE) || GET_ALLOC(next) ||
+       PREV_FREE(next) != bp || !checkBucketSize(next,index) ||
+       (is_sorted(a,GET_SIZE(bp)) && !sorts_before(a,bp,next))))
+    return CHECK_LIST;
+  return CHECK_OK;
+}
+
+/*
+  check the block bp of arena a, which has to end by limit. prev_alloc
+  is whether the block to its left is allocated, -1 if not known
+*/
+static int check_block(struct arena* a, char*bp, int prev_alloc, char*limit) {
+  unsigned int size = GET_SIZE(bp);
+  char* p = bp + WSIZE;
+  if (!aligned(p))
+    return CHECK_ALIGN;
+  if (size < MINSIZE || size > (size_t)(limit - bp))
+    return CHECK_SIZE;
+  if ((page_owner[page_index(bp)] & ~PAGE_SLAB) != a - arenas + 1)
+    return CHECK_OWNER;
+  if (prev_alloc >= 0 && GET_PREV_ALLOC(bp) != (unsigned int)prev_alloc)
+    return CHECK_PREV_ALLOC;
+  if (GET_ALLOC(bp) == 0)
+    return check_free(a,bp);
+  if (((size_t)p & (PAGE_SIZE-1)) == 0 && is_slab(p)) {
+    struct slab* s = (struct slab*)p;
+    if (size < PAGE_SIZE || s->cls >= NSLAB || s->nfree > s->nobj ||
+        s->nobj != (PAGE_SIZE - SLAB_HDR) / slab_size(s->cls) ||
+        s->bump < p + SLAB_HDR || s->bump > p + PAGE_SIZE)
+      return CHECK_SLAB;
+  }
+  return CHECK_OK;
+}
+
+/*
+  check what the block walk does not see: the bitmaps, the heads of the
+  seg lists, the quick lists and the partial slabs
+*/
+static int check_lists(struct arena* a, char** where) {
+  unsigned int index, nquick = 0;
+  for (index = 0; index < NBUCKETS; index++) {
+    char* ptr = a->buckets[index];
+    int set = (a->sl_bitmap[index >> SL_LOG2] >> (index & (SL_COUNT-1))) & 1;
+    if (set != (ptr != NULL) ||
+        ((a->fl_bitmap >> (index >> SL_LOG2)) & 1) != (a->sl_bitmap[index >> SL_LOG2] != 0))
+      return CHECK_BITMAP;
+    *where = ptr;
+    if (ptr != NULL && (!in_heap(ptr) || !aligned(ptr + WSIZE) || GET_ALLOC(ptr) ||
+                        PREV_FREE(ptr) != NULL || !checkBucketSize(ptr,index) ||
+                        arena_of(ptr) != a))
+      return CHECK_LIST;
+  }
+  for (index = 0; index < QL_COUNT; index++) {
+    char* ptr;
+    for (ptr = a->quick[index]; ptr != NULL; ptr = NEXT_OBJ(ptr)) {
+      *where = ptr - WSIZE;
+      if (GET_ALLOC(ptr-WSIZE) != 1 || GET_SIZE(ptr-WSIZE) != index*ALIGNMENT ||
+          ++nquick > a->nquick)
+        return CHECK_QUICK;
+    }
+  }
+  for (index = 0; index < NSLAB; index++) {
+    struct slab* s;
+    struct slab* prev = NULL;
+    for (s = a->slabs[index]; s != NULL; prev = s, s = s->next) {
+      *where = (char*)s - WSIZE;
+      if (!is_slab((char*)s) || arena_of((char*)s) != a || s->prev != prev ||
+          s->cls != index || s->nfree == 0 || s->nfree > s->nobj)
+        return CHECK_SLAB;
+    }
+  }
+  *where = NULL;
+  return CHECK_OK;
+}
+
+/*
+  check up to *nblocks more blocks of arena a, from where the last slice
+  stopped, and take them off *nblocks. Return CHECK_DONE once the arena
+  is done, the cursor then starts over. Caller holds the arena lock
+*/
+static int check_slice(struct arena* a, size_t* nblocks, char** where) {
+  char* region = a->check_region;
+  char* bp = a->check;
+  int prev_alloc = -1;  //a merge may have moved the cursor since
+  int ret = CHECK_OK;
+  if (bp == NULL) {
+    region = a->regions;
+    bp = region;  //at a region link, start on the region
+  }
+  while (ret == CHECK_OK) {
+    /* the cursor is at the previous region's link to this one, or
+       region is NULL at the end of the arena */
+    if (bp == region) {
+      if (region == NULL) {
+        ret = check_lists(a,where);
+        break;
+      }
+      *where = region + REGION_HDR;
+      if (GET(region + REGION_HDR) != PACK(0,1)) {
+        ret = CHECK_PROLOGUE;
+        break;
       }
-      if (ptr == NULL)
-	printf("did not find bucket\n");
-      if (GET_ALLOC(begin) != GET_ALLOC(begin+GET_SIZE(begin)))
-	printf("block is wrong\n");
-      if (!(aligned + WSIZE))
-	printf("align is in wrong\n");
-      begin = begin + GET_SIZE(begin);
+      bp = region + REGION_HDR + WSIZE;
+      prev_alloc = 1;
+    }
+    *where = bp;
+    if (region == a->regions ? bp == a->top : GET_SIZE(bp) == 0) {
+      if ((GET(bp) & ~PREV_ALLOC) != PACK(0,1))
+        ret = CHECK_EPILOGUE;
+      else if (prev_alloc >= 0 && GET_PREV_ALLOC(bp) != (unsigned int)prev_alloc)
+        ret = CHECK_PREV_ALLOC;
+      bp = region = *(char**)region;
+      continue;
     }
+    if (*nblocks == 0) {
+      a->check = bp;
+      a->check_region = region;
+      return CHECK_OK;
+    }
+    ret = check_block(a, bp, prev_alloc,
+                      region == a->regions ? a->top : __atomic_load_n(&heap_end, __ATOMIC_ACQUIRE));
+    prev_alloc = GET_ALLOC(bp);
+    bp += GET_SIZE(bp);
+    (*nblocks)--;
   }
-  
-  if (GET_ALLOC(prologue) != 1)
-    printf("invalid epilogue \n");  //check epilogue
-  if (GET_SIZE(prologue) !=0)
-    printf("invalid epilogue \n");
-  
-  while (index <=8) {  
-    char* ptr = *(heap_listp+index);  //check bucket
-    while (ptr != NULL) {
-      if (!in_heap(ptr))
-	printf("free pointer is out of bound\n");
-      if (!aligned(ptr+WSIZE))
-	printf("not aligned\n");
-      if (GET_ALLOC(ptr)==1)
-	printf("not free block\n");
-      if (!checkBucketSize(ptr,index))
-	printf("wrong bucket size\n");
-      ptr = NEXT_FREE(ptr);
-    }   
-    index++;
+  a->check = a->check_region = NULL;
+  return ret == CHECK_OK ? CHECK_DONE : ret;
+}
+
+/*
+  check up to nblocks blocks, arena after arena. Caller holds check_lock
+*/
+static int check_heap(size_t nblocks, char** where) {
+  int ret = CHECK_OK;
+  *where = NULL;
+  if (narenas == 0)
+    return CHECK_DONE;
+  while (ret == CHECK_OK) {
+    struct arena* a = &arenas[check_arena];
+    pthread_mutex_lock(&a->lock);
+    drain_remote(a);
+    ret = check_slice(a, &nblocks, where);
+    pthread_mutex_unlock(&a->lock);
+    if (ret == CHECK_OK)
+      break;  //out of blocks
+    check_arena = (check_arena + 1) % narenas;  //also after an error
+    if (ret == CHECK_DONE)
+      ret = check_arena == 0 ? CHECK_DONE : CHECK_OK;
+  }
+  return ret;
+}
+
+/*
+  check up to nblocks blocks of the heap, going on from where the last
+  call stopped. Return CHECK_OK, CHECK_DONE when the slice got to the
+  end of the heap, or one of the negative CHECK_* codes, with the header
+  of the block at fault in where if it is not NULL. After an error the
+  next call goes on with the next arena
+*/
+int mm_check(size_t nblocks, void** where) {
+  char* bp;
+  int ret;
+  pthread_mutex_lock(&check_lock);
+  ret = check_heap(nblocks, &bp);
+  pthread_mutex_unlock(&check_lock);
+  if (where != NULL)
+    *where = ret < 0 ? bp : NULL;
+  return ret;
+}
+
+/*
+  what a CHECK_* code means
+*/
+const char* mm_check_error(int code) {
+  if (code > 0)
+    return "done";
+  return -code < CHECK_ERRORS ? check_errors[-code] : "unknown error";
+}
+
+/*
+  check the whole heap in one go from the start, reporting every arena
+  at fault on stderr
+*/
+void mm_checkheap(int verbose) {
+  int i, ret;
+  char* bp;
+  pthread_mutex_lock(&check_lock);
+  for (i = 0; i < narenas; i++) {
+    pthread_mutex_lock(&arenas[i].lock);
+    arenas[i].check = arenas[i].check_region = NULL;
+    pthread_mutex_unlock(&arenas[i].lock);
   }
+  check_arena = 0;
+  do {
+    i = check_arena;
+    ret = check_heap((size_t)-1, &bp);
+    if (ret < 0)
+      fprintf(stderr, "arena %d: %s at %p\n", i, mm_check_error(ret), (void*)bp);
+  } while (ret < 0 && check_arena != 0);
+  pthread_mutex_unlock(&check_lock);
+  if (verbose && ret == CHECK_DONE)
+    fprintf(stderr, "heap ok\n");
 }
@@ -0,0 +1,555 @@
+/*
+ * replay.c
+ * Trace replay benchmark for mm.c in the DRIVER build.
+ *
+   Replays malloc lab traces against mm_malloc, mm_free and mm_realloc
+   and reports, per trace:
+     - throughput in ops/sec, the best of -r untimed runs
+     - p50, p99 and p999 latency of every kind of op, from a run that
+       times every op on its own
+     - peak live bytes against peak heap bytes (utilization). The heap
+       is what memlib handed out plus what mm.c mapped; the mapped
+       bytes come from mm.c's statistics, so an MM_STATS=0 build gets
+       neither this nor the fragmentation
+     - the fragmentation, 1 - live/heap, at -s points along the trace
+   Every run starts from mem_reset_brk and mm_init, with purging by the
+   clock turned off, so the same trace gives the same heap every time.
+
+   A trace is the text format of the malloc lab driver: four header
+   lines (suggested heap size, number of ids, number of ops, weight)
+   and then one op per line, "a id bytes", "r id bytes" or "f id".
+   Traces captured with MM_TRACE (see mm.c) are read too. Their records
+   are put in time order and every payload pointer becomes an id for as
+   long as it is live. Ops on pointers the capture never saw allocated
+   are dropped.
+
+   Build it next to memlib.c and mm.h from the driver:
+     gcc -O2 -DDRIVER -o replay replay.c mm.c memlib.c -lpthread
+   and run
+     ./replay [-r runs] [-s points] [-c] trace...
+   -c fills every payload and checks it before it is freed or moved, in
+   the run that times every op. Those checks stay outside the clock; the
+   throughput runs don't check.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+/* mm.h points malloc and friends at mm.c; the bookkeeping here uses libc */
+#undef malloc
+#undef free
+#undef realloc
+#undef calloc
+
+int mm_getstat(const char* name, size_t* value);  //see mm.c
+int mm_setopt(const char* name, size_t value);
+
+#define OP_ALLOC 0
+#define OP_REALLOC 1
+#define OP_FREE 2
+#define OP_CALLOC 3
+#define NOPKINDS 4
+
+#define TRACE_MAGIC "MMTRACE1"  /* first 8 bytes of a captured trace */
+#define PURGE_THRESHOLD (256UL << 10)  /* mm.c's default */
+
+/* a captured op, the layout of struct trace_rec in mm.c */
+struct trace_rec {
+  unsigned long time;
+  unsigned long ptr;
+  unsigned long old;
+  unsigned long size;
+  unsigned int thread;
+  unsigned int op;
+};
+
+/* a captured op and its place in the file, which breaks ties in time */
+struct capture {
+  struct trace_rec r;
+  size_t seq;
+};
+
+/* live payload pointers of a capture and their ids, open addressing */
+struct idmap {
+  unsigned long* ptr;  //0 is an empty slot, 1 one that was deleted
+  int* id;
+  size_t mask;
+};
+
+struct op {
+  int kind;
+  int id;
+  size_t size;
+};
+
+struct trace {
+  const char* name;
+  int nids;
+  int nops;
+  struct op* ops;
+};
+
+/* state of one replay */
+struct replay {
+  char** ptr;       //payload of every id
+  size_t* size;     //its requested size
+  size_t live;      //bytes requested and not freed
+  size_t peak_live;
+  size_t peak_heap;  //of the memlib heap, the mappings are added at the end
+};
+
+static const char* op_names[NOPKINDS] = { "malloc", "realloc", "free", "calloc" };
+static int check;  //-c
+static int stats;  //mm.c counts, so the mapped bytes are known
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static unsigned long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000UL + ts.tv_nsec;
+}
+
+static int cmp_capture(const void* x, const void* y) {
+  const struct capture* a = x;
+  const struct capture* b = y;
+  if (a->r.time != b->r.time)
+    return a->r.time < b->r.time ? -1 : 1;
+  return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+/* slot of ptr in the map, or of the empty slot where it would go */
+static size_t map_slot(struct idmap* m, unsigned long ptr) {
+  size_t i = (ptr >> 4) * 0x9e3779b97f4a7c15UL & m->mask;
+  while (m->ptr[i] != 0 && m->ptr[i] != ptr)
+    i = (i + 1) & m->mask;
+  return i;
+}
+
+/* id of the live pointer ptr, or -1 */
+static int map_find(struct idmap* m, unsigned long ptr) {
+  size_t i = map_slot(m, ptr);
+  return m->ptr[i] == ptr ? m->id[i] : -1;
+}
+
+/* forget ptr, leaving a tombstone */
+static void map_del(struct idmap* m, unsigned long ptr) {
+  size_t i = map_slot(m, ptr);
+  if (m->ptr[i] == ptr)
+    m->ptr[i] = 1;
+}
+
+/* ptr is live as id now. The caller has made sure it was not */
+static void map_put(struct idmap* m, unsigned long ptr, int id) {
+  size_t i = (ptr >> 4) * 0x9e3779b97f4a7c15UL & m->mask;
+  while (m->ptr[i] > 1)
+    i = (i + 1) & m->mask;
+  m->ptr[i] = ptr;
+  m->id[i] = id;
+}
+
+/* append an op to the trace */
+static void emit(struct trace* t, int kind, int id, size_t size) {
+  struct op* o = &t->ops[t->nops++];
+  o->kind = kind;
+  o->id = id;
+  o->size = size;
+}
+
+/*
+  turn the records of a capture, in time order, into ops on ids. mm.c
+  stamps a free before the block can be reused and a malloc after it
+  got one, so a pointer is never handed out while it is live; a record
+  that does so anyway is dropped and counted in bad
+*/
+static void convert_capture(struct trace* t, struct capture* c, size_t n, struct idmap* m, size_t* bad) {
+  size_t i;
+  for (i = 0; i < n; i++) {
+    struct trace_rec* r = &c[i].r;
+    int id = r->op == 'f' ? map_find(m, r->ptr) : (r->op == 'r' && r->old ? map_find(m, r->old) : -1);
+    int live = r->ptr != 0 && r->op != 'f' ? map_find(m, r->ptr) : -1;
+    if (live >= 0 && live != id) {
+      (*bad)++;
+      continue;
+    }
+    if (r->op == 'f') {
+      if (id >= 0) {
+        emit(t, OP_FREE, id, 0);
+        map_del(m, r->ptr);
+      }
+    }
+    else if (id >= 0) {  //a realloc of a live payload
+      if (r->ptr == 0 && r->size != 0)
+        continue;  //failed, the old payload stays
+      emit(t, r->ptr == 0 ? OP_FREE : OP_REALLOC, id, r->size);
+      map_del(m, r->old);
+      if (r->ptr != 0)
+        map_put(m, r->ptr, id);
+    }
+    else if (r->ptr != 0) {  //malloc, calloc, or a realloc of nothing we know
+      emit(t, r->op == 'c' ? OP_CALLOC : OP_ALLOC, t->nids, r->size);
+      map_put(m, r->ptr, t->nids++);
+    }
+  }
+}
+
+/*
+  read the records of a capture after its magic. Return -1 if memory
+  runs out
+*/
+static int read_capture(FILE* f, struct trace* t) {
+  struct capture* c = NULL;
+  struct idmap m;
+  size_t n = 0, cap = 0, bad = 0;
+  struct trace_rec r;
+  while (fread(&r, sizeof(r), 1, f) == 1) {
+    if (n == cap) {
+      struct capture* more = realloc(c, (cap = cap ? 2*cap : 4096) * sizeof(*c));
+      if (more == NULL) {
+        free(c);
+        return -1;
+      }
+      c = more;
+    }
+    c[n].r = r;
+    c[n].seq = n;
+    n++;
+  }
+  qsort(c, n, sizeof(*c), cmp_capture);
+  for (m.mask = 15; m.mask < 2*n; m.mask = 2*m.mask + 1)
+    ;
+  m.ptr = calloc(m.mask + 1, sizeof(unsigned long));
+  m.id = calloc(m.mask + 1, sizeof(int));
+  t->ops = malloc((n + 1) * sizeof(struct op));  //an op per record at most
+  t->nids = t->nops = 0;
+  if (m.ptr != NULL && m.id != NULL && t->ops != NULL)
+    convert_capture(t, c, n, &m, &bad);
+  if (bad != 0)
+    fprintf(stderr, "%s: dropped %zu records handing out a live pointer\n", t->name, bad);
+  free(c);
+  free(m.ptr);
+  free(m.id);
+  if (t->nids == 0)
+    t->nids = 1;
+  return m.ptr != NULL && m.id != NULL && t->ops != NULL ? 0 : -1;
+}
+
+/*
+  read the trace in path, a driver trace or a capture. Return -1 if it
+  cannot be read or is malformed
+*/
+static int read_trace(const char* path, struct trace* t) {
+  FILE* f = fopen(path, "r");
+  char magic[8], kind[2];
+  int heap, weight, i;
+  if (f == NULL) {
+    perror(path);
+    return -1;
+  }
+  t->name = path;
+  if (fread(magic, 8, 1, f) == 1 && memcmp(magic, TRACE_MAGIC, 8) == 0) {
+    i = read_capture(f, t);
+    fclose(f);
+    if (i < 0)
+      fprintf(stderr, "%s: out of memory\n", path);
+    return i;
+  }
+  rewind(f);
+  if (fscanf(f, "%d %d %d %d", &heap, &t->nids, &t->nops, &weight) != 4 ||
+      t->nids <= 0 || t->nops < 0) {
+    fprintf(stderr, "%s: bad header\n", path);
+    fclose(f);
+    return -1;
+  }
+  t->ops = calloc(t->nops, sizeof(struct op));
+  for (i = 0; t->ops != NULL && i < t->nops; i++) {
+    struct op* o = &t->ops[i];
+    if (fscanf(f, "%1s %d", kind, &o->id) != 2 || o->id < 0 || o->id >= t->nids)
+      break;
+    o->size = 0;
+    if (kind[0] == 'a')
+      o->kind = OP_ALLOC;
+    else if (kind[0] == 'r')
+      o->kind = OP_REALLOC;
+    else if (kind[0] == 'f')
+      o->kind = OP_FREE;
+    else
+      break;
+    if (o->kind != OP_FREE && fscanf(f, "%zu", &o->size) != 1)
+      break;
+  }
+  fclose(f);
+  if (t->ops == NULL || i < t->nops) {
+    fprintf(stderr, "%s: bad op %d\n", path, i + 1);
+    free(t->ops);
+    return -1;
+  }
+  return 0;
+}
+
+/* the statistic mm.c keeps of its mappings, mapped_size or mapped_peak */
+static size_t mapped_bytes(const char* name) {
+  size_t n = 0;
+  if (stats)
+    mm_getstat(name, &n);
+  return n;
+}
+
+/* MM_STATS=0 compiles the counters out, a malloc then counts nothing */
+static int have_stats(void) {
+  size_t n = 0;
+  mem_reset_brk();
+  if (mm_init() < 0)
+    return 0;
+  mm_free(mm_malloc(1));
+  return mm_getstat("nmalloc", &n) == 0 && n > 0;
+}
+
+static void fill(char* p, size_t n, int id) {
+  if (check && p != NULL)
+    memset(p, id & 0xff, n);
+}
+
+static int verify(const char* p, size_t n, int id) {
+  size_t i;
+  if (!check || p == NULL)
+    return 0;
+  for (i = 0; i < n; i++)
+    if ((unsigned char)p[i] != (id & 0xff))
+      return -1;
+  return 0;
+}
+
+/*
+  with -c, check the payload an op is about to free or move. Return -1
+  if it was overwritten
+*/
+static int before_op(struct replay* r, const struct op* o) {
+  if (o->kind == OP_ALLOC || o->kind == OP_CALLOC)
+    return 0;
+  return verify(r->ptr[o->id], r->size[o->id], o->id);
+}
+
+/*
+  run the op, outside of any checking so only the allocator is timed.
+  Return -1 if the allocator failed
+*/
+static int run_op(struct replay* r, const struct op* o) {
+  char* p = r->ptr[o->id];
+  size_t old = r->size[o->id];
+  if (o->kind == OP_ALLOC)
+    p = mm_malloc(o->size);
+  else if (o->kind == OP_CALLOC)
+    p = mm_calloc(1, o->size);
+  else if (o->kind == OP_REALLOC)
+    p = mm_realloc(p, o->size);
+  else {
+    mm_free(p);
+    p = NULL;
+  }
+  if (p == NULL && o->kind != OP_FREE && o->size != 0)
+    return -1;
+  r->ptr[o->id] = p;
+  r->size[o->id] = o->kind == OP_FREE ? 0 : o->size;
+  r->live += r->size[o->id] - (o->kind == OP_ALLOC || o->kind == OP_CALLOC ? 0 : old);
+  return 0;
+}
+
+/*
+  with -c, check that realloc kept the old contents, old bytes of them,
+  and fill the new payload. Return -1 if it did not
+*/
+static int after_op(struct replay* r, const struct op* o, size_t old) {
+  char* p = r->ptr[o->id];
+  if (o->kind == OP_REALLOC && verify(p, old < o->size ? old : o->size, o->id) < 0)
+    return -1;
+  if (o->kind != OP_FREE)
+    fill(p, o->size, o->id);
+  return 0;
+}
+
+static int start(struct replay* r, const struct trace* t) {
+  memset(r, 0, sizeof(*r));
+  r->ptr = calloc(t->nids, sizeof(char*));
+  r->size = calloc(t->nids, sizeof(size_t));
+  mem_reset_brk();
+  if (r->ptr == NULL || r->size == NULL || mm_init() < 0) {
+    fprintf(stderr, "%s: mm_init failed\n", t->name);
+    return -1;
+  }
+  /* purge whenever enough is dirty, not when enough time has passed */
+  mm_setopt("purge_interval", 0);
+  if (getenv("MM_PURGE_THRESHOLD") == NULL)
+    mm_setopt("purge_threshold", PURGE_THRESHOLD);
+  return 0;
+}
+
+static void finish(struct replay* r, const struct trace* t) {
+  int i;
+  for (i = 0; i < t->nids; i++)  //the heap goes away, but mappings would stay
+    if (r->ptr[i] != NULL)
+      mm_free(r->ptr[i]);
+  free(r->ptr);
+  free(r->size);
+}
+
+/*
+  replay the whole trace without looking at the clock per op, and
+  without -c so only the allocator is timed. Return the seconds it took,
+  or -1 if an op failed
+*/
+static double time_trace(const struct trace* t) {
+  struct replay r;
+  double t0, t1;
+  int i;
+  if (start(&r, t) < 0)
+    return -1;
+  t0 = now();
+  for (i = 0; i < t->nops; i++)
+    if (run_op(&r, &t->ops[i]) < 0)
+      break;
+  t1 = now();
+  finish(&r, t);
+  if (i < t->nops) {
+    fprintf(stderr, "%s: op %d failed\n", t->name, i + 1);
+    return -1;
+  }
+  return t1 - t0;
+}
+
+static int cmp_ulong(const void* x, const void* y) {
+  unsigned long a = *(const unsigned long*)x;
+  unsigned long b = *(const unsigned long*)y;
+  return a < b ? -1 : a > b;
+}
+
+/*
+  replay the trace timing every op, tracking the live and heap peaks
+  and printing the fragmentation at points evenly spread over it
+*/
+static int profile_trace(const struct trace* t, int points) {
+  struct replay r;
+  unsigned long* lat[NOPKINDS];
+  int nlat[NOPKINDS] = { 0 };
+  unsigned long overhead = ~0UL;
+  int i, k, step = stats && points > 0 && t->nops >= points ? t->nops / points : 0;
+  for (k = 0; k < NOPKINDS; k++) {
+    if ((lat[k] = malloc((t->nops + 1) * sizeof(unsigned long))) == NULL) {
+      fprintf(stderr, "%s: out of memory\n", t->name);
+      while (k-- > 0)
+        free(lat[k]);
+      return -1;
+    }
+  }
+  for (i = 0; i < 1000; i++) {  //cost of reading the clock twice
+    unsigned long a = now_ns(), b = now_ns();
+    if (b - a < overhead)
+      overhead = b - a;
+  }
+  if (start(&r, t) < 0) {
+    for (k = 0; k < NOPKINDS; k++)
+      free(lat[k]);
+    return -1;
+  }
+  if (step > 0)
+    printf("  %10s %12s %12s %7s\n", "op", "heap", "live", "frag");
+  for (i = 0; i < t->nops; i++) {
+    const struct op* o = &t->ops[i];
+    size_t old = r.size[o->id], heap;
+    unsigned long a, b;
+    if (before_op(&r, o) < 0)
+      break;
+    a = now_ns();
+    if (run_op(&r, o) < 0)
+      break;
+    b = now_ns();
+    if (after_op(&r, o, old) < 0)
+      break;
+    lat[o->kind][nlat[o->kind]++] = b - a > overhead ? b - a - overhead : 0;
+    heap = mem_heapsize();
+    if (r.live > r.peak_live)
+      r.peak_live = r.live;
+    if (heap > r.peak_heap)
+      r.peak_heap = heap;
+    if (step > 0 && (i + 1) % step == 0) {
+      heap += mapped_bytes("mapped_size");
+      printf("  %10d %12zu %12zu %6.1f%%\n", i + 1, heap, r.live,
+             heap ? 100.0 * (1 - (double)r.live / heap) : 0.0);
+    }
+  }
+  r.peak_heap += mapped_bytes("mapped_peak");  //at most, the two peaks may not coincide
+  if (i < t->nops)
+    fprintf(stderr, "%s: op %d failed\n", t->name, i + 1);
+  printf("  %-8s %8s %8s %8s %8s %10s\n", "latency", "ops", "p50", "p99", "p999", "max ns");
+  for (k = 0; k < NOPKINDS; k++) {
+    int n = nlat[k];
+    if (n == 0)
+      continue;
+    qsort(lat[k], n, sizeof(unsigned long), cmp_ulong);
+    printf("  %-8s %8d %8lu %8lu %8lu %10lu\n", op_names[k], n,
+           lat[k][n/2], lat[k][(long)n*99/100], lat[k][(long)n*999/1000], lat[k][n-1]);
+  }
+  if (stats)
+    printf("  peak live %zu bytes, peak heap %zu bytes, utilization %.1f%%\n",
+           r.peak_live, r.peak_heap, r.peak_heap ? 100.0 * r.peak_live / r.peak_heap : 0.0);
+  else
+    printf("  peak live %zu bytes, no heap size: mm.c is built with MM_STATS=0\n", r.peak_live);
+  finish(&r, t);
+  for (k = 0; k < NOPKINDS; k++)
+    free(lat[k]);
+  return i < t->nops ? -1 : 0;
+}
+
+int main(int argc, char** argv) {
+  int runs = 5, points = 10, failed = 0;
+  int i, k;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+      runs = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+      points = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-c") == 0)
+      check = 1;
+    else
+      break;
+  }
+  if (i == argc || runs < 1) {
+    fprintf(stderr, "usage: %s [-r runs] [-s points] [-c] trace...\n", argv[0]);
+    return 2;
+  }
+  mem_init();
+  stats = have_stats();
+  for (; i < argc; i++) {
+    struct trace t;
+    double best = -1;
+    if (read_trace(argv[i], &t) < 0) {
+      failed = 1;
+      continue;
+    }
+    printf("%s: %d ids, %d ops\n", t.name, t.nids, t.nops);
+    for (k = 0; k < runs; k++) {
+      double s = time_trace(&t);
+      if (s < 0)
+        break;
+      if (best < 0 || s < best)
+        best = s;
+    }
+    if (k < runs || profile_trace(&t, points) < 0)
+      failed = 1;
+    else
+      printf("  throughput %.0f ops/sec (best of %d)\n",
+             best > 0 ? t.nops / best : 0.0, runs);
+    free(t.ops);
+  }
+  return failed;
+}
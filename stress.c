@@ -0,0 +1,312 @@
+/*
+ * stress.c
+ * Multithreaded stress benchmarks for mm.c, comparable with glibc malloc.
+ *
+   Four tests, each run at 1, 2, 4, ... up to -t threads:
+     larson   server simulation: every thread replaces random blocks of
+              its own set, and between rounds the sets move on to the
+              next thread, so most blocks are freed by another thread
+     prodcons pairs of threads, one allocating and handing blocks over
+              a ring to the other, which frees them
+     churn    allocate a batch of blocks of one size, free it, again
+     realloc  grow and shrink a set of buffers to random sizes with
+              realloc, touching every new byte
+   For every run it prints the throughput in ops/sec and the resident
+   set size afterwards and at its peak. Every thread does -n ops so runs
+   are reproducible; the random sizes are seeded per thread.
+
+   The tests call malloc, free and realloc, the names the DRIVER
+   aliases in mm.h map to mm.c. Build it against mm.c with
+     gcc -O2 -DDRIVER -o stress stress.c mm.c memlib.c -lpthread
+   and against glibc malloc with
+     gcc -O2 -o stress-glibc stress.c -lpthread
+   memlib needs a MAX_HEAP of a few hundred MB for the larger thread
+   counts. Run
+     ./stress [-t threads] [-n ops] [test...]
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef DRIVER
+#include "mm.h"
+#include "memlib.h"
+#endif
+
+#define MAX_THREADS 256
+#define LARSON_SLOTS 1000   /* blocks per larson set */
+#define LARSON_ROUNDS 10    /* times the sets move on to the next thread */
+#define RING 1024           /* blocks in flight between a producer and its consumer */
+#define CHURN_BATCH 100
+#define CHURN_SIZE 64
+#define REALLOC_SLOTS 64
+#define REALLOC_MAX 65536
+
+struct test {
+  const char* name;
+  void* (*run)(void* arg);
+  int pairs;  //needs an even number of threads
+};
+
+/* what one thread of a run gets */
+struct worker {
+  int id;
+  int nthreads;
+  long ops;
+  unsigned long rng;
+};
+
+/* ring between a producer and a consumer, one writer per index */
+struct ring {
+  void* slot[RING];
+  unsigned long head __attribute__((aligned(64)));  //next slot the producer fills
+  unsigned long tail __attribute__((aligned(64)));  //next slot the consumer empties
+};
+
+static void** larson_sets[MAX_THREADS];
+static struct ring rings[MAX_THREADS / 2];
+static pthread_barrier_t barrier;
+
+static unsigned long rnd(struct worker* w) {
+  w->rng ^= w->rng << 13;
+  w->rng ^= w->rng >> 7;
+  w->rng ^= w->rng << 17;
+  return w->rng;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/*
+  each thread starts with a set of blocks of 8 to 1000 bytes, frees
+  random ones and allocates new ones in their place. After every round
+  the sets move on to the next thread
+*/
+static void* larson(void* arg) {
+  struct worker* w = arg;
+  long per_round = w->ops / LARSON_ROUNDS;
+  int set = w->id, r, i;
+  void** slots = malloc(LARSON_SLOTS * sizeof(void*));
+  for (i = 0; i < LARSON_SLOTS; i++) {
+    slots[i] = malloc(8 + rnd(w) % 993);
+    memset(slots[i], 1, 8);
+  }
+  larson_sets[set] = slots;
+  for (r = 0; r < LARSON_ROUNDS; r++) {
+    long k;
+    pthread_barrier_wait(&barrier);
+    slots = larson_sets[set];
+    for (k = 0; k < per_round; k++) {
+      i = rnd(w) % LARSON_SLOTS;
+      free(slots[i]);
+      slots[i] = malloc(8 + rnd(w) % 993);
+      memset(slots[i], 1, 8);
+    }
+    pthread_barrier_wait(&barrier);
+    set = (set + 1) % w->nthreads;  //the next thread's set, which it allocated
+  }
+  slots = larson_sets[set];
+  for (i = 0; i < LARSON_SLOTS; i++)
+    free(slots[i]);
+  pthread_barrier_wait(&barrier);  //everyone is done with the set arrays
+  free(slots);
+  return NULL;
+}
+
+/*
+  even threads allocate blocks of 16 to 512 bytes and pass them to the
+  odd thread after them, which frees them
+*/
+static void* prodcons(void* arg) {
+  struct worker* w = arg;
+  struct ring* q = &rings[w->id / 2];
+  long k;
+  if (w->id % 2 == 0) {
+    for (k = 0; k < w->ops; k++) {
+      char* p = malloc(16 + rnd(w) % 497);
+      p[0] = 1;
+      while (q->head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == RING)
+        sched_yield();
+      q->slot[q->head % RING] = p;
+      __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+  }
+  for (k = 0; k < w->ops; k++) {
+    while (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == q->tail)
+      sched_yield();
+    free(q->slot[q->tail % RING]);
+    __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+/* allocate a batch of blocks of one size and free it, over and over */
+static void* churn(void* arg) {
+  struct worker* w = arg;
+  void* batch[CHURN_BATCH];
+  long k;
+  int i;
+  for (k = 0; k < w->ops; k += 2*CHURN_BATCH) {
+    for (i = 0; i < CHURN_BATCH; i++) {
+      batch[i] = malloc(CHURN_SIZE);
+      *(char*)batch[i] = 1;
+    }
+    for (i = 0; i < CHURN_BATCH; i++)
+      free(batch[i]);
+  }
+  return NULL;
+}
+
+/* resize random buffers to random sizes, touching the bytes they gain */
+static void* realloc_test(void* arg) {
+  struct worker* w = arg;
+  char* buf[REALLOC_SLOTS] = { NULL };
+  size_t size[REALLOC_SLOTS] = { 0 };
+  long k;
+  int i;
+  for (k = 0; k < w->ops; k++) {
+    size_t n;
+    i = rnd(w) % REALLOC_SLOTS;
+    /* mostly small steps, now and then a jump anywhere */
+    n = rnd(w) % 8 ? size[i] + rnd(w) % 512 : 1 + rnd(w) % REALLOC_MAX;
+    if (n > REALLOC_MAX)
+      n = 1 + rnd(w) % 64;
+    buf[i] = realloc(buf[i], n);
+    if (n > size[i])
+      memset(buf[i] + size[i], 1, n - size[i]);
+    size[i] = n;
+  }
+  for (i = 0; i < REALLOC_SLOTS; i++)
+    free(buf[i]);
+  return NULL;
+}
+
+static const struct test tests[] = {
+  { "larson", larson, 0 },
+  { "prodcons", prodcons, 1 },
+  { "churn", churn, 0 },
+  { "realloc", realloc_test, 0 },
+};
+
+/*
+  read a field of /proc/self/status such as VmRSS, in KiB. The buffer
+  is on the stack so reading it does not allocate
+*/
+static long proc_status(const char* field) {
+  char buf[4096];
+  int fd = open("/proc/self/status", O_RDONLY);
+  ssize_t n;
+  char* p;
+  if (fd < 0)
+    return -1;
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return -1;
+  buf[n] = '\0';
+  if ((p = strstr(buf, field)) == NULL)
+    return -1;
+  return strtol(p + strlen(field) + 1, NULL, 10);
+}
+
+/* start the peak RSS over from the current one */
+static void reset_peak(void) {
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd < 0)
+    return;  //the peak then covers the whole process
+  if (write(fd, "5", 1) != 1)
+    fprintf(stderr, "cannot reset the peak RSS\n");
+  close(fd);
+}
+
+/*
+  run the test on n threads with a fresh heap and print how it went.
+  Return -1 if the threads could not be started
+*/
+static int run(const struct test* t, int n, long ops) {
+  pthread_t tid[MAX_THREADS];
+  struct worker w[MAX_THREADS];
+  double t0, t1;
+  int i;
+#ifdef DRIVER
+  mem_reset_brk();
+  if (mm_init() < 0)
+    return -1;
+#endif
+  memset(rings, 0, sizeof(rings));
+  pthread_barrier_init(&barrier, NULL, n);
+  reset_peak();
+  t0 = now();
+  for (i = 0; i < n; i++) {
+    w[i].id = i;
+    w[i].nthreads = n;
+    w[i].ops = ops;
+    w[i].rng = 0x9e3779b97f4a7c15UL * (i + 1);
+    if (pthread_create(&tid[i], NULL, t->run, &w[i]) != 0)
+      return -1;
+  }
+  for (i = 0; i < n; i++)
+    pthread_join(tid[i], NULL);
+  t1 = now();
+  pthread_barrier_destroy(&barrier);
+  printf("%-9s %3d threads %12.0f ops/sec  rss %7ld KiB  peak %7ld KiB\n",
+         t->name, n, n * ops / (t1 - t0), proc_status("VmRSS:"), proc_status("VmHWM:"));
+  fflush(stdout);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int maxthreads = cpus < 1 ? 1 : (cpus > MAX_THREADS ? MAX_THREADS : cpus);
+  long ops = 1000000;
+  unsigned int k;
+  int i, n, named = 0;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+      maxthreads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+      ops = atol(argv[++i]);
+    else
+      break;
+  }
+  if ((i < argc && argv[i][0] == '-') || maxthreads < 1 || maxthreads > MAX_THREADS || ops < 1) {
+    fprintf(stderr, "usage: %s [-t threads] [-n ops] [larson|prodcons|churn|realloc...]\n", argv[0]);
+    return 2;
+  }
+#ifdef DRIVER
+  mem_init();
+#endif
+  for (k = 0; k < sizeof(tests)/sizeof(tests[0]); k++) {
+    const struct test* t = &tests[k];
+    int j, max, want = i == argc;
+    for (j = i; j < argc; j++)
+      want |= strcmp(argv[j], t->name) == 0;
+    if (!want)
+      continue;
+    named++;
+    max = t->pairs ? maxthreads & ~1 : maxthreads;
+    if (max == 0)
+      printf("%-9s needs 2 threads\n", t->name);
+    for (n = t->pairs ? 2 : 1; max > 0; n = n*2 > max && n < max ? max : n*2) {
+      if (run(t, n, ops) < 0)
+        return 1;
+      if (n == max)
+        break;
+    }
+  }
+  if (named == 0) {
+    fprintf(stderr, "%s: no such test\n", argv[0]);
+    return 2;
+  }
+  return 0;
+}